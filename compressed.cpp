@@ -0,0 +1,449 @@
+#include <stdint.h>
+#include <string.h>
+#include <zlib.h>
+#include <zstd.h>
+#include "view.h"
+
+struct Comp_Decoder {
+	int format;
+	z_stream zs;
+	ZSTD_DCtx *zd;
+	bool raw; // gzip: decoding a bare deflate stream, so the member trailer still has to be skipped at the end of it
+	bool finished;
+
+	char in_buf[COMP_INPUT_SIZE];
+	int64_t in_pos; // file offset just past what was last read into in_buf
+	int64_t in_len;
+	int64_t in_used;
+	int64_t out_pos;
+
+	int64_t in_offset() {
+		return in_pos - (in_len - in_used);
+	}
+};
+
+static Comp_Decoder *make_decoder(int format) {
+	Comp_Decoder *d = new Comp_Decoder();
+	d->format = format;
+	d->finished = true;
+
+	if (format == COMP_GZIP)
+		inflateInit2(&d->zs, -15);
+	else
+		d->zd = ZSTD_createDCtx();
+
+	return d;
+}
+
+static void free_decoder(Comp_Decoder *d) {
+	if (!d)
+		return;
+
+	if (d->format == COMP_GZIP)
+		inflateEnd(&d->zs);
+	else
+		ZSTD_freeDCtx(d->zd);
+
+	delete d;
+}
+
+static bool fill_input(Comp_Decoder& d, File *file) {
+	if (d.in_used < d.in_len)
+		return true;
+
+	int64_t len = file->read_at(d.in_pos, d.in_buf, COMP_INPUT_SIZE);
+	if (len <= 0)
+		return false;
+
+	d.in_pos += len;
+	d.in_len = len;
+	d.in_used = 0;
+	return true;
+}
+
+static bool skip_input(Comp_Decoder& d, File *file, int64_t n) {
+	while (n > 0) {
+		if (!fill_input(d, file))
+			return false;
+
+		int64_t take = d.in_len - d.in_used < n ? d.in_len - d.in_used : n;
+		d.in_used += take;
+		n -= take;
+	}
+	return true;
+}
+
+// Concatenated gzip members are valid gzip files too (and common for logs), so decoding carries on into the next member
+static bool next_member(Comp_Decoder& d, File *file) {
+	if (d.raw && !skip_input(d, file, 8))
+		return false;
+
+	uint8_t magic[2];
+	if (file->read_at(d.in_offset(), (char*)magic, 2) != 2 || magic[0] != 0x1f || magic[1] != 0x8b)
+		return false;
+
+	inflateReset2(&d.zs, 31);
+	d.raw = false;
+	return true;
+}
+
+// Positions the decoder at a seek point. The caller holds the lock that keeps the point's window alive.
+static int start_decoder(Comp_Decoder& d, File *file, Comp_Point& pt) {
+	d.in_pos = pt.in_offset;
+	d.in_len = 0;
+	d.in_used = 0;
+	d.out_pos = pt.out_offset;
+	d.finished = false;
+
+	if (d.format == COMP_ZSTD) {
+		ZSTD_DCtx_reset(d.zd, ZSTD_reset_session_only);
+		return 0;
+	}
+
+	// The first point sits before the gzip header
+	if (!pt.window) {
+		inflateReset2(&d.zs, 31);
+		d.raw = false;
+		return 0;
+	}
+
+	inflateReset2(&d.zs, -15);
+	d.raw = true;
+
+	if (pt.bits) {
+		uint8_t c;
+		if (file->read_at(pt.in_offset - 1, (char*)&c, 1) != 1) {
+			d.finished = true;
+			return -1;
+		}
+		inflatePrime(&d.zs, pt.bits, c >> (8 - pt.bits));
+	}
+
+	inflateSetDictionary(&d.zs, (const Bytef*)pt.window, COMP_WINDOW_SIZE);
+	return 0;
+}
+
+// Runs the decoder once, writing up to len bytes to out. Returns the number of bytes written, or -1 at the end of the input.
+// *boundary is set if the decoder stopped somewhere that a seek point could be placed.
+static int64_t step_decoder(Comp_Decoder& d, File *file, char *out, int64_t len, bool *boundary) {
+	*boundary = false;
+
+	if (d.finished || !fill_input(d, file)) {
+		d.finished = true;
+		return -1;
+	}
+
+	if (d.format == COMP_ZSTD) {
+		ZSTD_inBuffer in = { d.in_buf, (size_t)d.in_len, (size_t)d.in_used };
+		ZSTD_outBuffer o = { out, (size_t)len, 0 };
+
+		size_t res = ZSTD_decompressStream(d.zd, &o, &in);
+		if (ZSTD_isError(res)) {
+			d.finished = true;
+			return -1;
+		}
+
+		d.in_used = in.pos;
+		d.out_pos += o.pos;
+
+		// Every frame can be decoded on its own
+		*boundary = res == 0;
+		return o.pos;
+	}
+
+	d.zs.next_in = (Bytef*)&d.in_buf[d.in_used];
+	d.zs.avail_in = (uInt)(d.in_len - d.in_used);
+	d.zs.next_out = (Bytef*)out;
+	d.zs.avail_out = (uInt)len;
+
+	int res = inflate(&d.zs, Z_BLOCK);
+
+	int64_t produced = len - d.zs.avail_out;
+	d.in_used = d.in_len - d.zs.avail_in;
+	d.out_pos += produced;
+
+	if (res == Z_STREAM_END) {
+		if (!next_member(d, file))
+			d.finished = true;
+		return produced;
+	}
+	if (res != Z_OK && res != Z_BUF_ERROR) {
+		d.finished = true;
+		return -1;
+	}
+
+	// Stopped at the end of a deflate block (or the header) which isn't the last one
+	*boundary = (d.zs.data_type & 128) && !(d.zs.data_type & 64);
+	return produced;
+}
+
+// Returns how much of out[0..len) could be filled before the input ran out
+static int64_t read_decoder(Comp_Decoder& d, File *file, char *out, int64_t len) {
+	int64_t done = 0;
+	bool boundary;
+
+	while (done < len) {
+		int64_t n = step_decoder(d, file, &out[done], len - done, &boundary);
+		if (n < 0)
+			break;
+		done += n;
+	}
+
+	return done;
+}
+
+void Compressed_File::add_point(Comp_Decoder *dec, const char *window) {
+	Comp_Point pt = {
+		.in_offset = dec->in_offset(),
+		.out_offset = dec->out_pos,
+		.bits = 0,
+		.window = nullptr
+	};
+
+	if (format == COMP_GZIP) {
+		pt.bits = dec->zs.data_type & 7;
+		pt.window = new char[COMP_WINDOW_SIZE];
+
+		// The window is a ring buffer, so it gets unrolled here
+		int64_t pos = dec->out_pos % COMP_WINDOW_SIZE;
+		memcpy(pt.window, &window[pos], COMP_WINDOW_SIZE - pos);
+		memcpy(&pt.window[COMP_WINDOW_SIZE - pos], window, pos);
+	}
+
+	std::lock_guard<std::mutex> lock(mtx);
+
+	int n = points.size;
+	points.resize(n + 1);
+	points.data[n] = pt;
+
+	int64_t point_bytes = sizeof(Comp_Point) + (format == COMP_GZIP ? COMP_WINDOW_SIZE : 0);
+
+	// Same as the line index: once over budget, drop every second point and space out the rest twice as far
+	while (points.size > 1 && (int64_t)points.size * point_bytes > COMP_INDEX_BUDGET) {
+		for (int i = 1; i < points.size; i += 2)
+			delete[] points.data[i].window;
+
+		int half = (points.size + 1) / 2;
+		for (int i = 1; i < half; i++)
+			points.data[i] = points.data[i * 2];
+
+		points.resize(half);
+		point_span *= 2;
+	}
+}
+
+void Compressed_File::build_index(File *file) {
+	Comp_Decoder *dec = make_decoder(format);
+	char *window = new char[COMP_WINDOW_SIZE]();
+
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		Comp_Point first = {0};
+		points.resize(1);
+		points.data[0] = first;
+		start_decoder(*dec, file, points.data[0]);
+	}
+
+	int64_t last_point = 0;
+
+	while (!cancel) {
+		int64_t pos = dec->out_pos % COMP_WINDOW_SIZE;
+		bool boundary;
+
+		int64_t n = step_decoder(*dec, file, &window[pos], COMP_WINDOW_SIZE - pos, &boundary);
+		if (n < 0)
+			break;
+
+		if (boundary && dec->out_pos - last_point >= point_span) {
+			add_point(dec, window);
+			last_point = dec->out_pos;
+		}
+
+		if (n > 0) {
+			size.store(dec->out_pos, std::memory_order_release);
+			if (file->on_stream_data && !file->stream_notified.exchange(true))
+				file->on_stream_data();
+		}
+	}
+
+	delete[] window;
+	free_decoder(dec);
+
+	done = true;
+	if (file->on_stream_data)
+		file->on_stream_data();
+}
+
+// Gets dec to 'offset', going back to the closest seek point unless it's already between that point and the offset.
+// Anything in between gets decompressed into scratch[0..scratch_len).
+int Compressed_File::seek(Comp_Decoder *dec, File *file, int64_t offset, char *scratch, int64_t scratch_len) {
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+
+		int lo = 0;
+		int hi = points.size;
+		while (hi - lo > 1) {
+			int mid = lo + (hi - lo) / 2;
+			if (points.data[mid].out_offset <= offset)
+				lo = mid;
+			else
+				hi = mid;
+		}
+
+		Comp_Point& pt = points.data[lo];
+		bool ahead = !dec->finished && dec->out_pos >= pt.out_offset && dec->out_pos <= offset;
+
+		if (!ahead && start_decoder(*dec, file, pt) < 0)
+			return -1;
+	}
+
+	while (dec->out_pos < offset) {
+		int64_t len = offset - dec->out_pos;
+		if (len > scratch_len)
+			len = scratch_len;
+
+		if (read_decoder(*dec, file, scratch, len) < len)
+			return -1;
+	}
+
+	return 0;
+}
+
+const char *Compressed_File::get(File *file, int64_t offset, int64_t *avail) {
+	int64_t start = offset & ~(FILE_CHUNK_SIZE - 1);
+	int64_t len = file->source_size - start;
+	if (len > FILE_CHUNK_SIZE)
+		len = FILE_CHUNK_SIZE;
+
+	Comp_Block *blk = nullptr;
+	for (int i = 0; i < n_blocks; i++) {
+		if (blocks[i].start == start) {
+			blk = &blocks[i];
+			break;
+		}
+	}
+
+	if (!blk) {
+		if (n_blocks < COMP_CACHE_BLOCKS) {
+			blk = &blocks[n_blocks++];
+			blk->data = new char[FILE_CHUNK_SIZE];
+		}
+		else {
+			blk = &blocks[0];
+			for (int i = 1; i < n_blocks; i++) {
+				if (blocks[i].last_used < blk->last_used)
+					blk = &blocks[i];
+			}
+		}
+
+		blk->start = start;
+		blk->len = 0;
+	}
+
+	// A block that was read while the background pass hadn't got to the end of it yet gets filled in the rest of the way
+	if (blk->len < len) {
+		if (seek(view_dec, file, start + blk->len, &blk->data[blk->len], FILE_CHUNK_SIZE - blk->len) < 0 ||
+			read_decoder(*view_dec, file, &blk->data[blk->len], len - blk->len) < len - blk->len)
+		{
+			blk->start = -1;
+			blk->len = 0;
+			*avail = 0;
+			return nullptr;
+		}
+		blk->len = len;
+	}
+
+	blk->last_used = ++block_clock;
+
+	*avail = blk->start + blk->len - offset;
+	return &blk->data[offset - blk->start];
+}
+
+const char *Compressed_File::read_sequential(File *file, int64_t offset, int64_t len) {
+	// The line index reads the file in order, so the decoder usually just carries on from the last read
+	if (offset != seq_start || seq_dec->out_pos != seq_start + seq_len) {
+		seq_start = offset;
+		seq_len = 0;
+
+		if (seek(seq_dec, file, offset, seq_buf, FILE_CHUNK_SIZE) < 0) {
+			seq_start = -1;
+			return nullptr;
+		}
+	}
+
+	if (seq_len < len) {
+		seq_len += read_decoder(*seq_dec, file, &seq_buf[seq_len], len - seq_len);
+		if (seq_len < len)
+			return nullptr;
+	}
+
+	return seq_buf;
+}
+
+void Compressed_File::destroy() {
+	for (int i = 0; i < points.size; i++)
+		delete[] points.data[i].window;
+	points.resize(0);
+
+	for (int i = 0; i < n_blocks; i++)
+		delete[] blocks[i].data;
+	n_blocks = 0;
+
+	free_decoder(view_dec);
+	free_decoder(seq_dec);
+	delete[] seq_buf;
+
+	view_dec = seq_dec = nullptr;
+	seq_buf = nullptr;
+}
+
+// Returns 1 if the file turned out to be compressed, in which case it gets read through 'comp' from then on
+int File::open_compressed() {
+	uint8_t magic[4] = {0};
+	if (read_at(0, (char*)magic, 4) != 4)
+		return 0;
+
+	int format = 0;
+	if (magic[0] == 0x1f && magic[1] == 0x8b)
+		format = COMP_GZIP;
+	else if (magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd)
+		format = COMP_ZSTD;
+	else
+		return 0;
+
+	data = nullptr;
+	source_size = 0;
+	total_size = 0;
+	n_windows = 0;
+	span_len = 0;
+	stream_notified = false;
+
+	comp = new Compressed_File();
+	comp->format = format;
+	comp->point_span = COMP_POINT_SPAN;
+	comp->view_dec = make_decoder(format);
+	comp->seq_dec = make_decoder(format);
+	comp->seq_buf = new char[FILE_CHUNK_SIZE];
+	comp->seq_start = -1;
+
+	Compressed_File *c = comp;
+	comp->indexer = std::thread([this, c]() { c->build_index(this); });
+	return 1;
+}
+
+void File::close_compressed() {
+	if (!comp)
+		return;
+
+	comp->cancel = true;
+	if (comp->indexer.joinable())
+		comp->indexer.join();
+
+	comp->destroy();
+	delete comp;
+
+	comp = nullptr;
+	source_size = 0;
+	total_size = 0;
+	span_len = 0;
+}
@@ -0,0 +1,472 @@
+#include <stdint.h>
+#include <string.h>
+#include <chrono>
+#include "view.h"
+
+static double get_seconds() {
+	auto now = std::chrono::steady_clock::now().time_since_epoch();
+	return std::chrono::duration<double>(now).count();
+}
+
+void Chunk_List::init() {
+	chunks = new char*[FILE_MAX_CHUNKS];
+	n_chunks = 0;
+	size = 0;
+}
+
+void Chunk_List::destroy() {
+	for (int i = 0; i < n_chunks; i++)
+		delete[] chunks[i];
+
+	delete[] chunks;
+	chunks = nullptr;
+	n_chunks = 0;
+}
+
+char *Chunk_List::reserve(int64_t *avail) {
+	int64_t end = size.load(std::memory_order_relaxed);
+	int64_t used = end % FILE_CHUNK_SIZE;
+
+	if (end == (int64_t)n_chunks * FILE_CHUNK_SIZE) {
+		if (n_chunks >= FILE_MAX_CHUNKS) {
+			*avail = 0;
+			return nullptr;
+		}
+
+		chunks[n_chunks++] = new char[FILE_CHUNK_SIZE];
+		used = 0;
+	}
+
+	*avail = FILE_CHUNK_SIZE - used;
+	return &chunks[n_chunks-1][used];
+}
+
+void Chunk_List::commit(int64_t len) {
+	size.store(size.load(std::memory_order_relaxed) + len, std::memory_order_release);
+}
+
+const char *Chunk_List::get(int64_t offset, int64_t *avail) {
+	int64_t idx = offset / FILE_CHUNK_SIZE;
+	int64_t inner = offset % FILE_CHUNK_SIZE;
+
+	*avail = FILE_CHUNK_SIZE - inner;
+	return &chunks[idx][inner];
+}
+
+int File::open(const char *name) {
+	int len = strlen(name);
+	path = new char[len + 1];
+	strcpy(path, name);
+
+	int res = open_source(name);
+	if (res >= 0 && !stream && !comp)
+		watch_source();
+
+	return res;
+}
+
+void File::close() {
+	finish_save();
+	lines.stop();
+	close_stream();
+	close_compressed();
+	close_source();
+
+	pieces.destroy();
+	journal.destroy();
+
+	delete[] path;
+	path = nullptr;
+	total_size = 0;
+}
+
+// Remembers what the file looks like now, so that refresh() can tell what changed later on
+void File::watch_source() {
+	if (stat_source(&watched, false) < 0)
+		memset(&watched, 0, sizeof(File_Stat));
+	if (stat_source(&watched_path, true) < 0)
+		watched_path = watched;
+
+	tail_len = source_size < FILE_TAIL_SAMPLE ? source_size : FILE_TAIL_SAMPLE;
+	if (tail_len > 0 && read_at(source_size - tail_len, tail_sample, tail_len) != tail_len)
+		tail_len = 0;
+}
+
+bool File::tail_unchanged() {
+	if (tail_len == 0)
+		return true;
+
+	char buf[FILE_TAIL_SAMPLE];
+	return read_at(source_size - tail_len, buf, tail_len) == tail_len && !memcmp(buf, tail_sample, tail_len);
+}
+
+int File::refresh() {
+	int64_t old_size = source_size;
+
+	if (!stream && !comp) {
+		int res = refresh_source();
+		if (res != REFRESH_GREW)
+			return res;
+	}
+	else {
+		stream_notified = false;
+
+		int64_t new_size = stream ? stream->size.load(std::memory_order_acquire) : comp->size.load(std::memory_order_acquire);
+		if (new_size <= source_size)
+			return 0;
+
+		source_size = new_size;
+		lines.extend(this, source_size);
+	}
+
+	// Whatever got added to the source shows up at the end of the text, after any edits
+	if (pieces.active && source_size > old_size)
+		pieces.append_source(this, old_size, source_size);
+	else
+		total_size = source_size;
+
+	span_len = 0;
+	return REFRESH_GREW;
+}
+
+// Checks whether another process appended to, rewrote or replaced the file since it was last looked at.
+// Appending only maps and indexes the new part. Otherwise, the line index is only thrown away from the first line that moved.
+int File::refresh_source() {
+	// The save worker reads from the open handle and the add buffer, neither of which can change under it
+	if (save.running)
+		return 0;
+
+	File_Stat now, at_path;
+	if (stat_source(&now, false) < 0)
+		return 0;
+
+	bool replaced = stat_source(&at_path, true) == 0 && (at_path.dev != watched_path.dev || at_path.ino != watched_path.ino);
+
+	// Edits were made against the old copy, which can still be read through the open handle, so that's what stays on screen.
+	// This is also what happens after saving, since that replaces the file too.
+	if (replaced && pieces.active) {
+		watched_path = at_path;
+		replaced = false;
+	}
+
+	if (!replaced && now.size == watched.size && now.mtime == watched.mtime)
+		return 0;
+
+	int64_t old_size = source_size;
+	int64_t keep = old_size; // everything below this is taken to be the same as before
+
+	if (replaced) {
+		lines.stop();
+		close_source();
+
+		if (open_source(path) < 0 || stream || comp) {
+			// Whatever's there now can't be read the same way, so the view just ends up empty
+			close_stream();
+			close_compressed();
+			lines.build_async(this, lines.max_bytes);
+			watched_path = at_path;
+			total_size = source_size;
+			return REFRESH_CHANGED;
+		}
+
+		keep = lines.first_mismatch(this, source_size < old_size ? source_size : old_size);
+	}
+	else {
+		// Growing without touching the old end is taken as an append, which is the one case that has to stay cheap
+		if (now.size <= old_size || !tail_unchanged())
+			keep = lines.first_mismatch(this, now.size < old_size ? now.size : old_size);
+
+		// The index worker might be reading the part that's about to go away
+		if (keep < old_size)
+			lines.stop();
+
+		refresh_mapping(now.size);
+	}
+
+	watch_source();
+
+	if (keep >= old_size && source_size >= old_size) {
+		lines.extend(this, source_size);
+		return REFRESH_GREW;
+	}
+
+	lines.truncate(keep);
+	lines.extend(this, source_size);
+
+	// Edits point into parts of the source that aren't there anymore
+	if (pieces.active) {
+		pieces.destroy();
+		journal.destroy();
+	}
+
+	total_size = source_size;
+	span_len = 0;
+	return REFRESH_CHANGED;
+}
+
+const char *File::get_span(int64_t offset, int64_t *avail) {
+	int64_t start, len;
+	const char *p = pieces.active ? pieces.get_block(this, offset, &start, &len) : get_source_block(offset, &start, &len);
+
+	if (!p) {
+		span_len = 0;
+		*avail = 0;
+		return nullptr;
+	}
+
+	span_ptr = p;
+	span_start = start;
+	span_len = len;
+
+	*avail = start + len - offset;
+	return &p[offset - start];
+}
+
+const char *File::get_source_block(int64_t offset, int64_t *start, int64_t *len) {
+	// This can unmap or reuse whatever the cached span points to
+	span_len = 0;
+
+	if (offset < 0 || offset >= source_size)
+		return nullptr;
+
+	if (data) {
+		*start = 0;
+		*len = source_size;
+		return data;
+	}
+
+	if (stream || comp) {
+		int64_t avail;
+		const char *p = stream ? stream->get(offset, &avail) : comp->get(this, offset, &avail);
+		if (!p)
+			return nullptr;
+
+		int64_t inner = offset % FILE_CHUNK_SIZE;
+		*start = offset - inner;
+		*len = inner + (avail < source_size - offset ? avail : source_size - offset);
+		return p - inner;
+	}
+
+	Mapped_Window *win = nullptr;
+	for (int i = 0; i < n_windows; i++) {
+		if (offset >= windows[i].start && offset < windows[i].start + windows[i].len) {
+			win = &windows[i];
+			break;
+		}
+	}
+
+	if (!win) {
+		if (n_windows < FILE_MAX_WINDOWS) {
+			win = &windows[n_windows++];
+		}
+		else {
+			win = &windows[0];
+			for (int i = 1; i < n_windows; i++) {
+				if (windows[i].last_used < win->last_used)
+					win = &windows[i];
+			}
+
+			unmap_range(win->ptr, win->len);
+		}
+
+		int64_t start = offset & ~(FILE_WINDOW_SIZE - 1);
+		int64_t len = source_size - start;
+		if (len > FILE_WINDOW_SIZE)
+			len = FILE_WINDOW_SIZE;
+
+		win->ptr = map_range(start, len);
+		win->start = start;
+		win->len = len;
+
+		if (!win->ptr) {
+			*win = windows[--n_windows];
+			return nullptr;
+		}
+	}
+
+	win->last_used = ++window_clock;
+
+	*start = win->start;
+	*len = win->len;
+	return win->ptr;
+}
+
+const char *File::acquire_range(int64_t offset, int64_t len) {
+	if (data)
+		return &data[offset];
+
+	if (stream) {
+		int64_t avail;
+		return stream->get(offset, &avail);
+	}
+
+	// Compressed files are decompressed into a single buffer, which stays locked until release_range()
+	if (comp) {
+		comp->seq_mtx.lock();
+		const char *p = comp->read_sequential(this, offset, len);
+		if (!p)
+			comp->seq_mtx.unlock();
+		return p;
+	}
+
+	return map_range(offset, len);
+}
+
+void File::release_range(const char *ptr, int64_t len) {
+	if (comp)
+		comp->seq_mtx.unlock();
+	else if (!data && !stream)
+		unmap_range((char*)ptr, len);
+}
+
+void File::open_stream() {
+	data = nullptr;
+	source_size = 0;
+	total_size = 0;
+	n_windows = 0;
+	span_len = 0;
+
+	stream = new Chunk_List();
+	stream->init();
+
+	stream_stop = false;
+	stream_done = false;
+	stream_notified = false;
+
+	Chunk_List *list = stream;
+	stream_reader = std::thread([this, list]() { read_stream(list); });
+}
+
+void File::read_stream(Chunk_List *list) {
+	while (!stream_stop) {
+		int64_t avail;
+		char *buf = list->reserve(&avail);
+		if (!buf)
+			break;
+
+		int64_t len = read_input(buf, avail);
+		if (len <= 0)
+			break;
+
+		list->commit(len);
+
+		// Only wake up the UI if it has picked up the last batch, instead of once per read
+		if (on_stream_data && !stream_notified.exchange(true))
+			on_stream_data();
+	}
+
+	stream_done = true;
+	if (on_stream_data)
+		on_stream_data();
+}
+
+void File::close_stream() {
+	if (!stream)
+		return;
+
+	stream_stop = true;
+
+	// The reader might be stuck waiting for input that never comes, in which case it gets left behind along with its chunks
+	if (stream_done) {
+		stream_reader.join();
+		stream->destroy();
+		delete stream;
+	}
+	else {
+		stream_reader.detach();
+	}
+
+	stream = nullptr;
+	source_size = 0;
+	total_size = 0;
+	span_len = 0;
+}
+
+void File::note_viewport(int64_t start, int64_t end) {
+	Prefetcher& pf = prefetch;
+	if (source_size <= 0 || stream || comp)
+		return;
+
+	double now = get_seconds();
+	if (pf.last_time == 0.0) {
+		pf.evicted_above = source_size;
+		pf.last_time = now;
+	}
+
+	int64_t delta = start - pf.view_start;
+	double dt = now - pf.last_time;
+
+	// Count the pages that just came into view which had already been asked for
+	int64_t new_lo = start;
+	int64_t new_hi = end;
+	if (delta > 0 && pf.view_end > new_lo)
+		new_lo = pf.view_end;
+	if (delta < 0 && pf.view_start < new_hi)
+		new_hi = pf.view_start;
+
+	int64_t hit_lo = new_lo > pf.ahead_start ? new_lo : pf.ahead_start;
+	int64_t hit_hi = new_hi < pf.ahead_end ? new_hi : pf.ahead_end;
+	if (hit_hi > hit_lo)
+		pf.faults_avoided += (hit_hi - hit_lo + 4095) / 4096;
+
+	if (delta != 0) {
+		int dir = delta > 0 ? 1 : -1;
+		double inst_speed = (double)(delta > 0 ? delta : -delta) / (dt > 0.001 ? dt : 0.001);
+
+		pf.speed = dir == pf.dir ? 0.7 * pf.speed + 0.3 * inst_speed : inst_speed;
+		pf.dir = dir;
+		pf.last_time = now;
+	}
+
+	pf.view_start = start;
+	pf.view_end = end;
+
+	int64_t ahead = (int64_t)(pf.speed * PREFETCH_LOOKAHEAD_SECS);
+	if (ahead < PREFETCH_MIN_AHEAD) ahead = PREFETCH_MIN_AHEAD;
+	if (ahead > PREFETCH_MAX_AHEAD) ahead = PREFETCH_MAX_AHEAD;
+
+	int64_t lo, hi, adv_lo, adv_hi;
+	if (pf.dir >= 0) {
+		lo = end;
+		hi = end + ahead < source_size ? end + ahead : source_size;
+
+		// Skip whatever the previous request already covered
+		adv_lo = lo >= pf.ahead_start && lo < pf.ahead_end ? pf.ahead_end : lo;
+		adv_hi = hi;
+	}
+	else {
+		lo = start - ahead > 0 ? start - ahead : 0;
+		hi = start;
+
+		adv_lo = lo;
+		adv_hi = hi > pf.ahead_start && hi <= pf.ahead_end ? pf.ahead_start : hi;
+	}
+
+	if (adv_hi > adv_lo) {
+		advise(adv_lo, adv_hi - adv_lo, ADVISE_WILLNEED);
+		pf.bytes_prefetched += adv_hi - adv_lo;
+	}
+
+	pf.ahead_start = lo;
+	pf.ahead_end = hi;
+
+	// Let the kernel reclaim anything that the viewport has left far enough behind
+	if (start < pf.evicted_below)
+		pf.evicted_below = start - PREFETCH_EVICT_BEHIND > 0 ? start - PREFETCH_EVICT_BEHIND : 0;
+	if (end > pf.evicted_above)
+		pf.evicted_above = end + PREFETCH_EVICT_BEHIND < source_size ? end + PREFETCH_EVICT_BEHIND : source_size;
+
+	int64_t cut = start - PREFETCH_EVICT_BEHIND;
+	if (pf.dir > 0 && cut > pf.evicted_below) {
+		advise(pf.evicted_below, cut - pf.evicted_below, ADVISE_COLD);
+		pf.bytes_evicted += cut - pf.evicted_below;
+		pf.evicted_below = cut;
+	}
+
+	cut = end + PREFETCH_EVICT_BEHIND;
+	if (pf.dir < 0 && cut < pf.evicted_above) {
+		advise(cut, pf.evicted_above - cut, ADVISE_COLD);
+		pf.bytes_evicted += pf.evicted_above - cut;
+		pf.evicted_above = cut;
+	}
+}
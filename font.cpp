@@ -5,13 +5,18 @@
 #include FT_BITMAP_H
 #include FT_STROKER_H
 
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
 #include <vector>
 
 typedef unsigned char u8;
 
-#define N_GLYPHS 384
 #define SLANT 0.2
 
+// Every slot starts on a 4-byte boundary, so that a slot can be copied into an image layer by itself
+#define SLOT_ALIGN(n) (((n) + 3) & ~3)
+
 #define FLOAT_FROM_16_16(n) ((float)((n) >> 16) + (float)((n) & 0xffff) / 65536.0)
 
 static FT_Library library = nullptr;
@@ -19,8 +24,6 @@ static FT_Stroker stroker = nullptr;
 
 static std::vector<FT_Face> font_faces;
 
-static bool g_italic = false;
-
 Font_Handle load_font_face(const char *path) {
 	if (!library) {
 		if (FT_Init_FreeType(&library) != 0) {
@@ -43,8 +46,8 @@ Font_Handle load_font_face(const char *path) {
 	return (Font_Handle)face;
 }
 
-const char *get_font_type_name(bool bold) {
-	if (g_italic) {
+const char *get_font_type_name(bool bold, bool italic) {
+	if (italic) {
 		if (bold)
 			return "bold-italic";
 		else
@@ -56,60 +59,272 @@ const char *get_font_type_name(bool bold) {
 	return "regular";
 }
 
+// Rasterizes one character into glyph slot 'idx' of render.buf. Returns false if the font doesn't have it.
+// Italics come from the transform that's set on the face, so 'italic' is only used for messages.
 template<bool bold>
-void render_ascii(Font_Render render, FT_Face face, int start_idx) {
-	for (int c = 0x20; c <= 0x7e; c++) {
-		FT_Bitmap bmp;
-		int left;
-		int top;
+static bool render_char(Font_Render render, FT_Face face, FT_Stroker stroker, bool italic, uint32_t c, int idx) {
+	FT_Bitmap bmp;
+	int left;
+	int top;
 
-		if constexpr (bold) {
-			FT_Load_Char(face, c, FT_LOAD_NO_BITMAP);
+	FT_Glyph glyph = nullptr;
 
-			FT_Glyph glyph;
-			FT_Get_Glyph(face->glyph, &glyph);
+	if constexpr (bold) {
+		if (FT_Load_Char(face, c, FT_LOAD_NO_BITMAP) != 0)
+			return false;
 
-			FT_Glyph_StrokeBorder(&glyph, stroker, 0, 1);
-			FT_Glyph_To_Bitmap(&glyph, FT_RENDER_MODE_NORMAL, nullptr, 1);
-			FT_BitmapGlyph bg = (FT_BitmapGlyph)glyph;
+		FT_Get_Glyph(face->glyph, &glyph);
 
-			bmp = bg->bitmap;
-			left = bg->left;
-			top = bg->top;
-		}
-		else {
-			FT_Load_Char(face, c, FT_LOAD_RENDER);
+		FT_Glyph_StrokeBorder(&glyph, stroker, 0, 1);
+		FT_Glyph_To_Bitmap(&glyph, FT_RENDER_MODE_NORMAL, nullptr, 1);
+		FT_BitmapGlyph bg = (FT_BitmapGlyph)glyph;
 
-			bmp = face->glyph->bitmap;
-			left = face->glyph->bitmap_left;
-			top = face->glyph->bitmap_top;
+		bmp = bg->bitmap;
+		left = bg->left;
+		top = bg->top;
+	}
+	else {
+		if (FT_Load_Char(face, c, FT_LOAD_RENDER) != 0)
+			return false;
+
+		bmp = face->glyph->bitmap;
+		left = face->glyph->bitmap_left;
+		top = face->glyph->bitmap_top;
+	}
+
+	int w = (int)bmp.width;
+	int h = (int)bmp.rows;
+	int x = render.overlap_w + left;
+	int y = render.baseline - top;
+
+	// HACK
+	if (x < 0) x = 0;
+
+	if (y < 0 || x + w > render.glyph_img_w || y + h > render.glyph_h) {
+		if (c < 0x80)
+			fprintf(stderr, "%s: '%c' doesn't fit: glyph=(%d,%d,%dx%d), frame=%dx%d\n", get_font_type_name(bold, italic), c, x, y, w, h, render.glyph_img_w, render.glyph_h);
+
+		// Wide glyphs from outside ASCII get cut off at the edges of the slot instead
+		if (c < 0x80 || y < 0 || x >= render.glyph_img_w || y >= render.glyph_h) {
+			if (glyph)
+				FT_Done_Glyph(glyph);
+			return true;
 		}
 
-		int w = (int)bmp.width;
-		int h = (int)bmp.rows;
-		int x = render.overlap_w + left;
-		int y = render.baseline - top;
+		if (x + w > render.glyph_img_w) w = render.glyph_img_w - x;
+		if (y + h > render.glyph_h) h = render.glyph_h - y;
+	}
 
-		// HACK
-		if (x < 0) x = 0;
+	int offset = idx * render.slot_size + y * render.glyph_img_w;
 
-		if (x < 0 || y < 0 || x + w > render.glyph_img_w || y + h > render.glyph_h) {
-			fprintf(stderr, "%s: '%c' doesn't fit: glyph=(%d,%d,%dx%d), frame=%dx%d\n", get_font_type_name(false), c, x, y, w, h, render.glyph_img_w, render.glyph_h);
-			continue;
+	for (int i = 0; i < h; i++) {
+		u8 *in = &bmp.buffer[i * bmp.pitch];
+		u8 *out = &render.buf[offset + x];
+		memcpy(out, in, w);
+		offset += render.glyph_img_w;
+	}
+
+	if (glyph)
+		FT_Done_Glyph(glyph);
+
+	return true;
+}
+
+// Distance fields are made from an outline that's rasterized SDF_UPSAMPLE times bigger than the glyph
+static Font_Render upsampled(Font_Render render) {
+	render.points *= SDF_UPSAMPLE;
+	render.baseline *= SDF_UPSAMPLE;
+	render.overlap_w *= SDF_UPSAMPLE;
+	render.glyph_img_w *= SDF_UPSAMPLE;
+	render.glyph_w *= SDF_UPSAMPLE;
+	render.glyph_h *= SDF_UPSAMPLE;
+	return render;
+}
+
+static void set_style(Font_Render render, FT_Face face, FT_Stroker stroker, int style) {
+	if (render.format == GLYPH_FORMAT_SDF)
+		render = upsampled(render);
+
+	FT_Set_Char_Size(face, 0, render.points, render.dpi_w, render.dpi_h);
+	FT_Stroker_Set(stroker, render.points / 20, FT_STROKER_LINECAP_ROUND, FT_STROKER_LINEJOIN_ROUND, 0);
+
+	FT_Matrix matrix = {
+		.xx = 0x10000,
+		.xy = (int)(SLANT * 0x10000),
+		.yx = 0,
+		.yy = 0x10000
+	};
+	FT_Set_Transform(face, (style & 2) ? &matrix : nullptr, nullptr);
+}
+
+// Squared distance transform of one row or column (Felzenszwalb & Huttenlocher), from f into d
+static void edt_1d(const float *f, float *d, int n, int *v, float *z) {
+	auto intersect = [f](int q, int p) {
+		return ((f[q] + (float)(q*q)) - (f[p] + (float)(p*p))) / (float)(2*q - 2*p);
+	};
+
+	int k = 0;
+	v[0] = 0;
+	z[0] = -1e20f;
+	z[1] = 1e20f;
+
+	for (int q = 1; q < n; q++) {
+		float s = intersect(q, v[k]);
+		while (s <= z[k]) {
+			k--;
+			s = intersect(q, v[k]);
 		}
 
-		int idx = start_idx + c - 0x20;
-		int offset = (idx * render.glyph_h + y) * render.glyph_img_w;
+		k++;
+		v[k] = q;
+		z[k] = s;
+		z[k+1] = 1e20f;
+	}
+
+	k = 0;
+	for (int q = 0; q < n; q++) {
+		while (z[k+1] < (float)q)
+			k++;
+
+		float dq = (float)(q - v[k]);
+		d[q] = dq*dq + f[v[k]];
+	}
+}
+
+// Squared distance from every pixel to the nearest pixel where (coverage >= 128) == inside
+static void edt_2d(const u8 *img, int w, int h, bool inside, float *dist, float *col_in, float *col_out, int *v, float *z) {
+	for (int i = 0; i < w*h; i++)
+		dist[i] = ((img[i] >= 128) == inside) ? 0.0f : 1e20f;
+
+	for (int x = 0; x < w; x++) {
+		for (int y = 0; y < h; y++)
+			col_in[y] = dist[y*w + x];
+
+		edt_1d(col_in, col_out, h, v, z);
 
-		for (int i = 0; i < h; i++) {
-			u8 *in = &bmp.buffer[i*w];
-			u8 *out = &render.buf[offset + x];
-			memcpy(out, in, w);
-			offset += render.glyph_img_w;
+		for (int y = 0; y < h; y++)
+			dist[y*w + x] = col_out[y];
+	}
+
+	for (int y = 0; y < h; y++) {
+		memcpy(col_in, &dist[y*w], w * sizeof(float));
+		edt_1d(col_in, &dist[y*w], w, v, z);
+	}
+}
+
+// Turns an upsampled coverage bitmap into a signed distance field at the glyph's real size.
+// 0.5 is the outline, and the value goes up by 0.5 / SDF_SPREAD per pixel towards the inside.
+static void make_sdf(const u8 *hi, Font_Render render, u8 *out) {
+	int w = render.glyph_img_w * SDF_UPSAMPLE;
+	int h = render.glyph_h * SDF_UPSAMPLE;
+	int n = w > h ? w : h;
+
+	static thread_local std::vector<float> scratch;
+	static thread_local std::vector<int> v;
+	scratch.resize(2*w*h + 3*n + 1);
+	v.resize(n);
+
+	float *to_inside = &scratch[0];
+	float *to_outside = &scratch[w*h];
+	float *col_in = &scratch[2*w*h];
+	float *col_out = &col_in[n];
+	float *z = &col_out[n];
+
+	edt_2d(hi, w, h, true, to_inside, col_in, col_out, v.data(), z);
+	edt_2d(hi, w, h, false, to_outside, col_in, col_out, v.data(), z);
+
+	auto signed_dist = [&](int p) {
+		// Distances are measured between pixel centres, so half a pixel puts the outline in between
+		return to_inside[p] > 0.0f ? sqrtf(to_inside[p]) - 0.5f : 0.5f - sqrtf(to_outside[p]);
+	};
+
+	for (int y = 0; y < render.glyph_h; y++) {
+		for (int x = 0; x < render.glyph_img_w; x++) {
+			// The centre of the pixel falls between the middle 2x2 of the upsampled pixels
+			int p = (y * SDF_UPSAMPLE + SDF_UPSAMPLE/2 - 1) * w + x * SDF_UPSAMPLE + SDF_UPSAMPLE/2 - 1;
+
+			float d = signed_dist(p) + signed_dist(p + 1) + signed_dist(p + w) + signed_dist(p + w + 1);
+			d /= 4.0f * (float)SDF_UPSAMPLE;
+
+			float value = 0.5f - d * (0.5f / (float)SDF_SPREAD);
+			value = value < 0.0f ? 0.0f : value > 1.0f ? 1.0f : value;
+			out[y * render.glyph_img_w + x] = (u8)(value * 255.0f + 0.5f);
 		}
 	}
 }
 
+static bool render_styled_char(Font_Render render, FT_Face face, FT_Stroker stroker, int style, uint32_t c, int idx) {
+	bool italic = (style & 2) != 0;
+
+	if (style & 1)
+		return render_char<true>(render, face, stroker, italic, c, idx);
+	else
+		return render_char<false>(render, face, stroker, italic, c, idx);
+}
+
+// Copies one slot's worth of 8-bit values into slot 'idx', packing them down to 4 bits each if need be
+static void store_slot(Font_Render render, const u8 *values, int idx) {
+	int n_pixels = render.glyph_img_w * render.glyph_h;
+	u8 *out = &render.buf[idx * render.slot_size];
+
+	if (render.bits == 8) {
+		memcpy(out, values, n_pixels);
+		return;
+	}
+
+	// Low nibble first, rounded to the nearest of the 16 levels
+	for (int i = 0; i < n_pixels; i += 2) {
+		int lo = (values[i] * 15 + 127) / 255;
+		int hi = i + 1 < n_pixels ? (values[i+1] * 15 + 127) / 255 : 0;
+		out[i >> 1] = (u8)(lo | hi << 4);
+	}
+}
+
+// Renders one character in the given style into slot 'idx', as coverage or as a distance field.
+// The face has to have been set up for the style with set_style().
+static bool render_glyph(Font_Render render, FT_Face face, FT_Stroker stroker, int style, uint32_t c, int idx) {
+	// 8-bit coverage can go straight into the slot
+	if (render.format != GLYPH_FORMAT_SDF && render.bits == 8)
+		return render_styled_char(render, face, stroker, style, c, idx);
+
+	static thread_local std::vector<u8> values;
+	values.assign(render.glyph_img_w * render.glyph_h, 0);
+
+	Font_Render one = render;
+	one.buf = values.data();
+
+	bool found;
+	if (render.format == GLYPH_FORMAT_SDF) {
+		Font_Render hi = upsampled(render);
+
+		static thread_local std::vector<u8> hi_buf;
+		hi_buf.assign(hi.glyph_img_w * hi.glyph_h, 0);
+		hi.buf = hi_buf.data();
+
+		found = render_styled_char(hi, face, stroker, style, c, 0);
+		if (found)
+			make_sdf(hi.buf, render, one.buf);
+	}
+	else {
+		found = render_styled_char(one, face, stroker, style, c, 0);
+	}
+
+	if (found)
+		store_slot(render, values.data(), idx);
+
+	return found;
+}
+
+// Style 0 is regular, 1 is bold, 2 is italic and 3 is bold italic
+static void render_ascii(Font_Render render, FT_Face face, FT_Stroker stroker, int style) {
+	set_style(render, face, stroker, style);
+
+	int start_idx = style * GLYPHSET_SIZE;
+
+	for (int c = 0x20; c <= 0x7e; c++)
+		render_glyph(render, face, stroker, style, c, start_idx + c - 0x20);
+}
+
 Font_Render size_up_font_render(Font_Handle fh, float size, float dpi_w, float dpi_h) {
 	auto face = (FT_Face)fh;
 
@@ -141,30 +356,385 @@ Font_Render size_up_font_render(Font_Handle fh, float size, float dpi_w, float d
 		.glyph_img_w = glyph_img_w,
 		.glyph_w = glyph_w,
 		.glyph_h = glyph_h,
-		.total_size = N_GLYPHS * glyph_img_w * glyph_h
+		.total_size = N_GLYPHS * SLOT_ALIGN(glyph_img_w * glyph_h),
+		.slot_size = SLOT_ALIGN(glyph_img_w * glyph_h),
+		.bits = 8,
+		.format = GLYPH_FORMAT_COVERAGE,
+		.cell_w = glyph_w,
+		.cell_h = glyph_h
 	};
 }
 
-void make_font_render(Font_Handle fh, Font_Render render) {
-	auto face = (FT_Face)fh;
+// Glyphs can be stored with 8 or 4 bits per pixel. At 4 bits, two pixels share a byte, low nibble first.
+void set_glyph_bits(Font_Render& render, int bits) {
+	int n_pixels = render.glyph_img_w * render.glyph_h;
 
-	FT_Set_Char_Size(face, 0, render.points, render.dpi_w, render.dpi_h);
-	FT_Stroker_Set(stroker, render.points / 20, FT_STROKER_LINECAP_ROUND, FT_STROKER_LINEJOIN_ROUND, 0);
+	render.bits = bits == 4 ? 4 : 8;
+	render.slot_size = SLOT_ALIGN(render.bits == 4 ? (n_pixels + 1) / 2 : n_pixels);
+	render.total_size = N_GLYPHS * render.slot_size;
+}
 
-	render_ascii<false>(render, face, 0);
-	render_ascii<true>(render, face, 96);
+// Changes how big the cells are on screen without rasterizing anything again, which is only worth doing with distance fields
+void zoom_font_render(Font_Render& render, float size) {
+	float scale = size * 64.0f / (float)render.points;
 
-	FT_Matrix matrix = {
-		.xx = 0x10000,
-		.xy = (int)(SLANT * 0x10000),
-		.yx = 0,
-		.yy = 0x10000
+	render.cell_w = (int)((float)render.glyph_w * scale + 0.5f);
+	render.cell_h = (int)((float)render.glyph_h * scale + 0.5f);
+
+	if (render.cell_w < 1) render.cell_w = 1;
+	if (render.cell_h < 1) render.cell_h = 1;
+}
+
+#define GLYPH_CACHE_MAGIC 0x31594c4748534d4dULL // "MMSHGLY1"
+
+struct Glyph_Cache_Header {
+	uint64_t magic;
+	uint64_t font_hash;
+	int32_t points;
+	float dpi_w;
+	float dpi_h;
+	int32_t glyph_img_w;
+	int32_t glyph_h;
+	int32_t total_size;
+	int32_t format;
+	int32_t bits;
+};
+
+static uint64_t fnv1a(const char *data, int64_t len) {
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for (int64_t i = 0; i < len; i++) {
+		h ^= (uint8_t)data[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+// Each style gets its own library, face and stroker, since FreeType objects can't be shared between threads
+static void bake_worker(Glyph_Bake *bake, int style) {
+	FT_Library lib = nullptr;
+	FT_Face face = nullptr;
+	FT_Stroker st = nullptr;
+
+	if (FT_Init_FreeType(&lib) != 0) {
+		bake->n_failed++;
+		return;
+	}
+
+	if (FT_New_Memory_Face(lib, (const FT_Byte*)bake->font_data, (FT_Long)bake->font_size, 0, &face) == 0 &&
+		FT_Stroker_New(lib, &st) == 0)
+	{
+		Font_Render render = bake->render;
+		render.buf = bake->pixels;
+		render_ascii(render, face, st, style);
+	}
+	else {
+		bake->n_failed++;
+	}
+
+	if (st)
+		FT_Stroker_Done(st);
+	if (face)
+		FT_Done_Face(face);
+
+	FT_Done_FreeType(lib);
+}
+
+void Glyph_Bake::start(const char *font_path, Font_Render font_render) {
+	render = font_render;
+	pixels = nullptr;
+	font_data = nullptr;
+	cache_path = nullptr;
+	cache_map = nullptr;
+	n_failed = 0;
+	running = false;
+
+	FILE *f = fopen(font_path, "rb");
+	if (f) {
+		fseek(f, 0, SEEK_END);
+		font_size = (int64_t)ftell(f);
+		fseek(f, 0, SEEK_SET);
+
+		font_data = new char[font_size > 0 ? font_size : 1];
+		if (font_size <= 0 || (int64_t)fread(font_data, 1, font_size, f) != font_size)
+			n_failed = 1;
+
+		fclose(f);
+	}
+	else {
+		n_failed = 1;
+	}
+
+	if (n_failed == 0) {
+		font_hash = fnv1a(font_data, font_size);
+
+		char name[96];
+		const char *fmt = render.format == GLYPH_FORMAT_SDF ? "-sdf" : "";
+		snprintf(name, sizeof(name), "glyphs-%016llx-%d-%dx%d%s-%dbpp.bin", (unsigned long long)font_hash, render.points, (int)render.dpi_w, (int)render.dpi_h, fmt, render.bits);
+		cache_path = get_cache_path(name);
+
+		if (load_cache())
+			return;
+	}
+
+	pixels = new unsigned char[render.total_size]();
+	if (n_failed > 0)
+		return;
+
+	for (int i = 0; i < 4; i++)
+		workers[i] = std::thread(bake_worker, this, i);
+
+	running = true;
+}
+
+bool Glyph_Bake::load_cache() {
+	if (!cache_path)
+		return false;
+
+	int64_t size = 0;
+	char *ptr = map_cache_file(cache_path, &size);
+	if (!ptr)
+		return false;
+
+	auto hdr = (Glyph_Cache_Header*)ptr;
+	bool match =
+		size >= (int64_t)sizeof(Glyph_Cache_Header) &&
+		hdr->magic == GLYPH_CACHE_MAGIC &&
+		hdr->font_hash == font_hash &&
+		hdr->points == render.points &&
+		hdr->dpi_w == render.dpi_w &&
+		hdr->dpi_h == render.dpi_h &&
+		hdr->glyph_img_w == render.glyph_img_w &&
+		hdr->glyph_h == render.glyph_h &&
+		hdr->total_size == render.total_size &&
+		hdr->format == render.format &&
+		hdr->bits == render.bits &&
+		size == (int64_t)sizeof(Glyph_Cache_Header) + render.total_size;
+
+	if (!match) {
+		unmap_cache_file(ptr, size);
+		return false;
+	}
+
+	cache_map = ptr;
+	cache_map_size = size;
+	pixels = (unsigned char*)&ptr[sizeof(Glyph_Cache_Header)];
+	return true;
+}
+
+// Written to a temporary file first, so that another instance never maps half of one
+void Glyph_Bake::store_cache() {
+	if (!cache_path)
+		return;
+
+	int len = strlen(cache_path);
+	char *temp_path = new char[len + 8];
+	memcpy(temp_path, cache_path, len);
+	memcpy(&temp_path[len], ".tmp", 5);
+
+	Glyph_Cache_Header hdr = {
+		.magic = GLYPH_CACHE_MAGIC,
+		.font_hash = font_hash,
+		.points = render.points,
+		.dpi_w = render.dpi_w,
+		.dpi_h = render.dpi_h,
+		.glyph_img_w = render.glyph_img_w,
+		.glyph_h = render.glyph_h,
+		.total_size = render.total_size,
+		.format = render.format,
+		.bits = render.bits
 	};
-	FT_Set_Transform(face, &matrix, nullptr);
-	g_italic = true;
 
-	render_ascii<false>(render, face, 192);
-	render_ascii<true>(render, face, 288);
+	FILE *f = fopen(temp_path, "wb");
+	if (f) {
+		bool ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1 && fwrite(pixels, 1, render.total_size, f) == (size_t)render.total_size;
+		ok = fclose(f) == 0 && ok;
+
+		remove(cache_path);
+		if (!ok || rename(temp_path, cache_path) != 0)
+			remove(temp_path);
+	}
+
+	delete[] temp_path;
+}
+
+// Waits for the workers if there are any, and returns the glyphsets
+unsigned char *Glyph_Bake::finish() {
+	if (running) {
+		for (int i = 0; i < 4; i++)
+			workers[i].join();
+
+		running = false;
+
+		if (n_failed == 0)
+			store_cache();
+		else
+			fprintf(stderr, "Failed to rasterize glyphsets\n");
+	}
+
+	delete[] font_data;
+	font_data = nullptr;
+
+	return pixels;
+}
+
+void Glyph_Bake::destroy() {
+	finish();
+
+	if (cache_map)
+		unmap_cache_file(cache_map, cache_map_size);
+	else
+		delete[] pixels;
+
+	delete[] cache_path;
+	pixels = nullptr;
+	cache_map = nullptr;
+	cache_path = nullptr;
+}
+
+void Glyph_Cache::init(Font_Handle font_face, Font_Render font_render, int first, int count, int per_frame) {
+	face = font_face;
+	render = font_render;
+	first_slot = first;
+	n_slots = count > 0 ? count : 0;
+	max_per_frame = per_frame;
+
+	keys      = new uint32_t[n_slots];
+	last_used = new int64_t[n_slots];
+	lru_prev  = new int[n_slots];
+	lru_next  = new int[n_slots];
+	chain     = new int[n_slots];
+	dirty     = new int[per_frame];
+
+	n_buckets = 64;
+	while (n_buckets < n_slots)
+		n_buckets *= 2;
+
+	buckets = new int[n_buckets];
+	for (int i = 0; i < n_buckets; i++)
+		buckets[i] = -1;
+
+	lru_head = lru_tail = -1;
+	n_used = 0;
+	frame = 0;
+	cur_style = -1;
+	n_rasterized = 0;
+	n_dirty = 0;
+	deferred = false;
+	out_of_slots = false;
+}
+
+void Glyph_Cache::destroy() {
+	delete[] keys;
+	delete[] last_used;
+	delete[] lru_prev;
+	delete[] lru_next;
+	delete[] chain;
+	delete[] dirty;
+	delete[] buckets;
+	keys = nullptr;
+	buckets = nullptr;
+	n_slots = 0;
+}
+
+void Glyph_Cache::begin_frame() {
+	frame++;
+	n_rasterized = 0;
+	n_dirty = 0;
+	deferred = false;
+	out_of_slots = false;
+}
+
+void Glyph_Cache::unlink(int s) {
+	if (lru_prev[s] >= 0) lru_next[lru_prev[s]] = lru_next[s];
+	else                  lru_head = lru_next[s];
+
+	if (lru_next[s] >= 0) lru_prev[lru_next[s]] = lru_prev[s];
+	else                  lru_tail = lru_prev[s];
+}
+
+void Glyph_Cache::push_front(int s) {
+	lru_prev[s] = -1;
+	lru_next[s] = lru_head;
+
+	if (lru_head >= 0)
+		lru_prev[lru_head] = s;
+	else
+		lru_tail = s;
+
+	lru_head = s;
+}
+
+static inline uint32_t hash_key(uint32_t key, int n_buckets) {
+	return (key * 0x9e3779b1u) >> 7 & (uint32_t)(n_buckets - 1);
+}
+
+// Returns the glyph slot for a character in one of the 4 styles, rasterizing it if it isn't cached yet
+uint32_t Glyph_Cache::lookup(uint32_t cp, int style) {
+	uint32_t fallback = style * GLYPHSET_SIZE + GLYPH_FALLBACK;
+	if (n_slots <= 0)
+		return fallback;
+
+	uint32_t key = cp << 2 | (uint32_t)style;
+	uint32_t b = hash_key(key, n_buckets);
+
+	for (int s = buckets[b]; s >= 0; s = chain[s]) {
+		if (keys[s] == key) {
+			last_used[s] = frame;
+			unlink(s);
+			push_front(s);
+			return first_slot + s;
+		}
+	}
+
+	auto ft_face = (FT_Face)face;
+	if (FT_Get_Char_Index(ft_face, cp) == 0)
+		return fallback;
+
+	if (n_rasterized >= max_per_frame) {
+		deferred = true;
+		return fallback;
+	}
+
+	// Take a slot that was never used, or else the least recently used one, as long as it isn't on screen in this frame
+	int s;
+	if (n_used < n_slots) {
+		s = n_used++;
+	}
+	else {
+		s = lru_tail;
+		if (last_used[s] == frame) {
+			out_of_slots = true;
+			return fallback;
+		}
+
+		unlink(s);
+
+		uint32_t old_b = hash_key(keys[s], n_buckets);
+		int *link = &buckets[old_b];
+		while (*link != s)
+			link = &chain[*link];
+		*link = chain[s];
+	}
+
+	keys[s] = key;
+	last_used[s] = frame;
+	chain[s] = buckets[b];
+	buckets[b] = s;
+	push_front(s);
+
+	int slot = first_slot + s;
+	memset(&render.buf[slot * render.slot_size], 0, render.slot_size);
+
+	if (style != cur_style) {
+		set_style(render, ft_face, stroker, style);
+		cur_style = style;
+	}
+
+	render_glyph(render, ft_face, stroker, style, cp, slot);
+
+	dirty[n_dirty++] = slot;
+	n_rasterized++;
+	return slot;
 }
 
 void ft_quit() {
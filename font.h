@@ -1,7 +1,25 @@
 #pragma once
 
+#include <stdint.h>
+#include <atomic>
+#include <thread>
+
 typedef void* Font_Handle;
 
+// Printable ASCII in each of the 4 styles (regular, bold, italic, bold italic), 0x60 slots apiece.
+// Slot 0x5f of each style (0x7f - ' ') is the box that stands in for anything without a glyph.
+#define N_GLYPHS 384
+#define GLYPHSET_SIZE 0x60
+#define GLYPH_FALLBACK 0x5f
+
+// Glyphs are either stored as coverage, one byte per pixel, or as signed distance fields that can be drawn at any size.
+// A distance field is made from an outline rasterized SDF_UPSAMPLE times bigger, and covers SDF_SPREAD pixels either side of the edge.
+#define GLYPH_FORMAT_COVERAGE 0
+#define GLYPH_FORMAT_SDF      1
+
+#define SDF_UPSAMPLE 4
+#define SDF_SPREAD   4
+
 // Note: it is currently the responsibility of the application to manage Font_Render::buf
 struct Font_Render {
 	unsigned char *buf;
@@ -14,6 +32,13 @@ struct Font_Render {
 	int glyph_w;
 	int glyph_h;
 	int total_size;
+	int slot_size; // bytes per glyph, a multiple of 4
+	int bits;      // per pixel, 8 or 4
+	int format;
+
+	// The size of a cell on screen. Only distance fields can be drawn at a different size to glyph_w * glyph_h.
+	int cell_w;
+	int cell_h;
 
 	/*
 	int get_full_glyph_width() {
@@ -22,7 +47,84 @@ struct Font_Render {
 	*/
 };
 
+// Glyphs outside printable ASCII are rasterized the first time they're shown, into the slots after the ASCII glyphsets.
+// Once every slot has been used, the least recently used glyph gets replaced. Only max_per_frame glyphs are rasterized
+// per frame, and anything past that shows up as the box until the next frame (which 'deferred' asks for).
+// If every slot is already on screen in this frame, the rest show up as the box too, but another frame wouldn't help ('out_of_slots').
+struct Glyph_Cache {
+	Font_Handle face;
+	Font_Render render;
+	int first_slot;
+	int n_slots;
+	int max_per_frame;
+
+	// Per slot, relative to first_slot
+	uint32_t *keys; // code point << 2 | style
+	int64_t *last_used;
+	int *lru_prev; // most recently used first
+	int *lru_next;
+	int *chain;    // next slot in the same hash bucket
+
+	int *buckets;
+	int n_buckets;
+	int lru_head;
+	int lru_tail;
+	int n_used;
+
+	int64_t frame;
+	int cur_style; // the style that the face is currently set up for
+	int n_rasterized;
+	bool deferred;
+	bool out_of_slots;
+
+	// Slots that were rasterized this frame and still have to be uploaded
+	int *dirty;
+	int n_dirty;
+
+	void init(Font_Handle font_face, Font_Render font_render, int first, int count, int per_frame);
+	void destroy();
+	void begin_frame();
+	uint32_t lookup(uint32_t cp, int style);
+
+	void unlink(int s);
+	void push_front(int s);
+};
+
+// Produces the ASCII glyphsets, either by mapping them from a cache file from an earlier launch, or else by
+// rasterizing the 4 styles on their own threads (each with its own FreeType library and face) while the caller
+// gets on with something else. The cache file is keyed by a hash of the font file, the point size and the DPI.
+struct Glyph_Bake {
+	Font_Render render;
+	unsigned char *pixels; // N_GLYPHS slots, render.total_size bytes
+
+	char *font_data;
+	int64_t font_size;
+	uint64_t font_hash;
+	char *cache_path;
+
+	char *cache_map;
+	int64_t cache_map_size;
+
+	std::thread workers[4];
+	std::atomic<int> n_failed;
+	bool running;
+
+	void start(const char *font_path, Font_Render font_render);
+	unsigned char *finish();
+	void destroy();
+
+	bool load_cache();
+	void store_cache();
+};
+
 Font_Handle load_font_face(const char *path);
 Font_Render size_up_font_render(Font_Handle font_face, float size, float dpi_w, float dpi_h);
-void make_font_render(Font_Handle font_face, Font_Render render);
+void set_glyph_bits(Font_Render& render, int bits);
+void zoom_font_render(Font_Render& render, float size);
 void ft_quit(void);
+
+// Platform parts of the glyph cache file, in io-linux.cpp / io-windows.cpp.
+// get_cache_path() creates the cache directory if it has to, and returns a new[]'d path, or null.
+char *get_cache_path(const char *name);
+char *map_cache_file(const char *path, int64_t *size);
+void unmap_cache_file(char *ptr, int64_t size);
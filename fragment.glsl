@@ -3,21 +3,24 @@
 const uint N_GLYPHS = 384;
 const uint THUMB_WIDTH = 16;
 
-struct Cell {
-	uint glyph;
-	uint modifier;
-	uint foreground;
-	uint background;
-};
+// These match font.h and mash.h
+const uint GLYPH_FORMAT_SDF = 1;
+const uint GLYPH_SOURCE_IMAGE = 1;
+const float SDF_SPREAD = 4.0;
 
+// The palette comes first, then each frame's cells, packed as in view.h:
+// glyph in the low 16 bits, then 5 bits each of foreground and background palette index, then the modifier
 layout (binding = 0) buffer readonly restrict GRID {
-	Cell grid[];
+	uint grid[];
 };
 
 layout (binding = 1) buffer readonly restrict GLYPH_BUFFER {
 	uint glyph_buffer[];
 };
 
+// The same glyphs as an R8 array image with one layer per slot, when glyph_source is GLYPH_SOURCE_IMAGE
+layout (binding = 2) uniform sampler2DArray glyph_image;
+
 layout (push_constant) uniform PARAMS {
 	uvec2 view_origin;
 	uvec2 view_size;
@@ -27,16 +30,31 @@ layout (push_constant) uniform PARAMS {
 	uint thumb_color;
 	uint cursor_color;
 	uint columns;
-	uint grid_cell_offset;     // offset in cells (16 or so bytes)
+	uint grid_cell_offset;     // offset in cells (4 bytes each)
 	uint glyphset_byte_offset; // offset in bytes
 	uint glyph_overlap_w;
 	uint glyph_full_w;
+	uint glyph_h;
+	uint glyph_format;
+	uint glyph_bits;           // 8, or 4 with two pixels per byte
+	uint glyph_slot_size;      // bytes per glyph
+	uint glyph_source;
+	float glyph_scale;         // glyph pixels per screen pixel
+	uint grid_rows;
+	uint grid_row_base;        // the grid is a ring of rows, so scrolling only uploads the rows that came into view
 } params;
 
 layout (location = 0) out vec4 outColor;
 
-float get_glyph_value(uint slot, uint pos, uint full_cell_w) {
-	uint idx = params.glyphset_byte_offset + (slot * full_cell_w * params.cell_size.y) + pos;
+float get_glyph_value(uint slot, uint pos) {
+	if (params.glyph_bits == 4) {
+		uint nibble = 2 * (params.glyphset_byte_offset + slot * params.glyph_slot_size) + pos;
+
+		uint value = (glyph_buffer[nibble / 8] >> ((nibble & 7) * 4)) & 0xf;
+		return float(value) / 15.0;
+	}
+
+	uint idx = params.glyphset_byte_offset + (slot * params.glyph_slot_size) + pos;
 
 	uint shift = (idx & 3) * 8;
 	uint value = (glyph_buffer[idx / 4] >> shift) & 0xff;
@@ -44,10 +62,52 @@ float get_glyph_value(uint slot, uint pos, uint full_cell_w) {
 	return float(value) / 255.0;
 }
 
+// Coverage of a glyph at a point measured in glyph pixels
+float sample_glyph(uint slot, vec2 p) {
+	uint w = params.glyph_full_w;
+
+	if (params.glyph_source == GLYPH_SOURCE_IMAGE) {
+		if (params.glyph_format != GLYPH_FORMAT_SDF) {
+			ivec2 ip = min(ivec2(p), ivec2(w - 1u, params.glyph_h - 1u));
+			return texelFetch(glyph_image, ivec3(ip, slot), 0).r;
+		}
+
+		// The sampler does the bilinear filtering here
+		vec2 uv = p / vec2(w, params.glyph_h);
+		float dist = texture(glyph_image, vec3(uv, float(slot))).r;
+
+		float edge = 0.25 * params.glyph_scale / SDF_SPREAD;
+		return smoothstep(0.5 - edge, 0.5 + edge, dist);
+	}
+
+	if (params.glyph_format != GLYPH_FORMAT_SDF) {
+		uvec2 ip = uvec2(p);
+		return get_glyph_value(slot, ip.y * w + ip.x);
+	}
+
+	// Distance fields get filtered bilinearly, and the edge is smoothed over about one pixel on screen
+	uvec2 last = uvec2(w - 1u, params.glyph_h - 1u);
+	vec2 q = clamp(p - 0.5, vec2(0.0), vec2(last));
+	uvec2 a = uvec2(q);
+	uvec2 b = min(a + 1u, last);
+	vec2 t = q - vec2(a);
+
+	float top = mix(get_glyph_value(slot, a.y * w + a.x), get_glyph_value(slot, a.y * w + b.x), t.x);
+	float bottom = mix(get_glyph_value(slot, b.y * w + a.x), get_glyph_value(slot, b.y * w + b.x), t.x);
+	float dist = mix(top, bottom, t.y);
+
+	float edge = 0.25 * params.glyph_scale / SDF_SPREAD;
+	return smoothstep(0.5 - edge, 0.5 + edge, dist);
+}
+
 vec3 get_color(uint c) {
 	return vec3((c >> 24) & 0xff, (c >> 16) & 0xff, (c >> 8) & 0xff) / 255.0;
 }
 
+vec3 get_palette_color(uint idx) {
+	return get_color(grid[idx & 0x1f]);
+}
+
 void main() {
 	uvec2 view_pos = uvec2(gl_FragCoord.xy) - params.view_origin;
 
@@ -60,7 +120,8 @@ void main() {
 	}
 
 	uint cell_w = params.cell_size.x;
-	uint full_cell_w = params.glyph_full_w;
+	float scale = params.glyph_scale;
+	float overlap = float(params.glyph_overlap_w);
 
 	uint outer_row = view_pos.y / params.cell_size.y;
 	uint inner_row = view_pos.y % params.cell_size.y;
@@ -71,18 +132,20 @@ void main() {
 	uint bar_h   = 1 + (params.cell_size.y / 20);
 	uint bar_mid = (params.cell_size.y - bar_h) / 2;
 
-	uint row_start_cell = params.grid_cell_offset + outer_row * params.columns;
+	uint ring_row = (outer_row + params.grid_row_base) % params.grid_rows;
+	uint row_start_cell = params.grid_cell_offset + ring_row * params.columns;
 
 	uint cell_idx = row_start_cell + outer_col;
-	uint modifier = grid[cell_idx].modifier;
+	uint cell = grid[cell_idx];
+	uint modifier = (cell >> 26) & 3;
 	uint top = modifier * bar_mid;
 
-	vec3 back = get_color(grid[cell_idx].background);
-	vec3 fore_cur = get_color(grid[cell_idx].foreground);
+	vec3 back = get_palette_color(cell >> 21);
+	vec3 fore_cur = get_palette_color(cell >> 16);
 	vec3 fore = fore_cur;
 	float lum = 0.0;
 
-	if (outer_row == params.cursor.y && outer_col == params.cursor.x && inner_col < params.glyph_overlap_w) {
+	if (outer_row == params.cursor.y && outer_col == params.cursor.x && float(inner_col) * scale < overlap) {
 		lum = 1.0;
 		fore = get_color(params.cursor_color);
 	}
@@ -90,22 +153,22 @@ void main() {
 		lum = 1.0;
 	}
 	else {
-		uint glyph_pixel_offset = inner_row * full_cell_w;
-		uint next_threshold = full_cell_w - params.glyph_overlap_w;
+		// Where this pixel lands in the glyph, which has room for overlap on either side of the cell
+		vec2 pos = (vec2(inner_col, inner_row) + 0.5) * scale;
+		pos.x += overlap;
 
-		uint pos = glyph_pixel_offset + inner_col + params.glyph_overlap_w;
-		float value_cur = get_glyph_value(grid[cell_idx].glyph, pos, full_cell_w);
+		float value_cur = sample_glyph(cell & 0xffff, pos);
 		lum = value_cur;
 
-		if (outer_col > 0 && inner_col <= params.glyph_overlap_w) {
-			uint prev_pos = glyph_pixel_offset + cell_w + params.glyph_overlap_w + inner_col;
-			uint prev_idx = cell_idx - 1;
-			float value_prev = get_glyph_value(grid[prev_idx].glyph, prev_pos, full_cell_w);
+		if (outer_col > 0 && float(inner_col) * scale <= overlap) {
+			vec2 prev_pos = vec2(pos.x + float(cell_w) * scale, pos.y);
+			uint prev_cell = grid[cell_idx - 1];
+			float value_prev = sample_glyph(prev_cell & 0xffff, prev_pos);
 
 			float value = value_cur + value_prev;
 			if (value > 0.0) {
 				lum = clamp(value, 0.0, 1.0);
-				fore = mix(fore_cur, get_color(grid[prev_idx].foreground), value_prev / value);
+				fore = mix(fore_cur, get_palette_color(prev_cell >> 16), value_prev / value);
 			}
 		}
 	}
@@ -0,0 +1,65 @@
+#include <stdio.h>
+#include <string.h>
+#include "font.h"
+
+#define TEST_SLOTS 8
+
+static int fail(const char *what) {
+	printf("FAIL: %s\n", what);
+	return 1;
+}
+
+int main(int argc, char **argv) {
+	if (argc != 2) {
+		printf("Glyph Cache Test\n"
+			"Usage: %s <font file with Latin-1 glyphs>\n", argv[0]);
+		return 1;
+	}
+
+	Font_Handle face = load_font_face(argv[1]);
+	if (!face)
+		return 2;
+
+	Font_Render render = size_up_font_render(face, 10, 96, 96);
+	auto buf = new unsigned char[(N_GLYPHS + TEST_SLOTS) * render.slot_size];
+	render.buf = buf;
+
+	// Twice as many glyphs as slots on one screen: the ones that don't fit stay as the box, without asking for more frames
+	Glyph_Cache gc = {0};
+	gc.init(face, render, N_GLYPHS, TEST_SLOTS, 64);
+
+	for (int f = 0; f < 3; f++) {
+		gc.begin_frame();
+		for (uint32_t cp = 0xc0; cp < 0xc0 + 2 * TEST_SLOTS; cp++)
+			gc.lookup(cp, 0);
+
+		if (!gc.out_of_slots)
+			return fail("every slot is on screen, but out_of_slots isn't set");
+		if (gc.deferred)
+			return fail("deferred is set when no later frame could do better");
+	}
+	gc.destroy();
+
+	// Going over max_per_frame still asks for another frame, which then gets the rest done
+	gc = {0};
+	gc.init(face, render, N_GLYPHS, TEST_SLOTS, 2);
+
+	gc.begin_frame();
+	for (uint32_t cp = 0xc0; cp < 0xc4; cp++)
+		gc.lookup(cp, 0);
+	if (!gc.deferred || gc.out_of_slots)
+		return fail("going over max_per_frame doesn't set deferred");
+
+	gc.begin_frame();
+	for (uint32_t cp = 0xc0; cp < 0xc4; cp++)
+		gc.lookup(cp, 0);
+	if (gc.deferred)
+		return fail("deferred is still set once everything got rasterized");
+
+	gc.destroy();
+	delete[] buf;
+	ft_quit();
+
+	printf("ok\n");
+	return 0;
+}
@@ -1,33 +1,344 @@
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/sendfile.h>
 #include "view.h"
 
-int File::open(const char *name) {
+int File::open_source(const char *name) {
 	memset(os_handle, 0, sizeof(os_handle));
+	data = nullptr;
+	n_windows = 0;
+	span_len = 0;
 
-	int fd = ::open(name, O_RDONLY);
+	bool is_stdin = !strcmp(name, "-");
+
+	int fd = is_stdin ? STDIN_FILENO : ::open(name, O_RDONLY);
 	if (fd < 0)
 		return -1;
 
 	struct stat st;
-	fstat(fd, &st);
-	int64_t size = st.st_size;
-
-	data = (char*)mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
-	total_size = size;
+	if (fstat(fd, &st) != 0) {
+		if (!is_stdin)
+			::close(fd);
+		return -2;
+	}
 
 	((int*)os_handle)[0] = fd;
+
+	// Pipes, FIFOs and terminals get read in the background instead of being mapped
+	if (!S_ISREG(st.st_mode)) {
+		open_stream();
+		return 0;
+	}
+
+	// Compressed files are decompressed on demand instead of being mapped
+	if (open_compressed() > 0)
+		return 0;
+
+	source_size = st.st_size;
+
+	if (source_size > 0 && source_size <= FILE_WHOLE_MAP_LIMIT) {
+		void *ptr = mmap(nullptr, source_size, PROT_READ, MAP_SHARED, fd, 0);
+
+		// If mapping the whole file fails, fall back to mapping it in windows
+		if (ptr != MAP_FAILED)
+			data = (char*)ptr;
+	}
+
+	total_size = source_size;
+	return 0;
+}
+
+// Maps the file again after it changed size, keeping as much of the old mapping as still fits.
+// If the file shrank, the index worker has to be stopped first, since it could be reading past the new end.
+int File::refresh_mapping(int64_t new_size) {
+	int fd = ((int*)os_handle)[0];
+
+	int64_t old_size = source_size;
+	if (new_size == old_size)
+		return 0;
+
+	if (data) {
+		// The mapping may move, so the index worker can't be reading from it in the meantime
+		lines.stop();
+
+		void *ptr = MAP_FAILED;
+		if (new_size > 0 && new_size <= FILE_WHOLE_MAP_LIMIT)
+			ptr = mremap(data, old_size, new_size, MREMAP_MAYMOVE);
+
+		if (ptr == MAP_FAILED) {
+			munmap(data, old_size);
+			data = nullptr;
+		}
+		else {
+			data = (char*)ptr;
+		}
+	}
+	else if (old_size == 0 && new_size <= FILE_WHOLE_MAP_LIMIT) {
+		void *ptr = mmap(nullptr, new_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (ptr != MAP_FAILED)
+			data = (char*)ptr;
+	}
+	else {
+		// Any window that was cut short by the old end of the file, or that reaches past the new one, has to be mapped again
+		for (int i = 0; i < n_windows; i++) {
+			if (windows[i].len < FILE_WINDOW_SIZE || windows[i].start + windows[i].len > new_size) {
+				munmap(windows[i].ptr, windows[i].len);
+				windows[i--] = windows[--n_windows];
+			}
+		}
+	}
+
+	source_size = new_size;
+	span_len = 0;
+	return 1;
+}
+
+int File::stat_source(File_Stat *st, bool at_path) {
+	int fd = ((int*)os_handle)[0];
+
+	struct stat s;
+	if ((at_path ? stat(path, &s) : fstat(fd, &s)) != 0)
+		return -1;
+
+	st->dev = (uint64_t)s.st_dev;
+	st->ino = (uint64_t)s.st_ino;
+	st->size = (int64_t)s.st_size;
+	st->mtime = (int64_t)s.st_mtim.tv_sec * 1000000000LL + (int64_t)s.st_mtim.tv_nsec;
+	return 0;
+}
+
+int64_t File::read_input(char *buf, int64_t len) {
+	int fd = ((int*)os_handle)[0];
+
+	while (true) {
+		ssize_t res = read(fd, buf, len);
+		if (res >= 0 || errno != EINTR)
+			return (int64_t)res;
+	}
+}
+
+int64_t File::read_at(int64_t offset, char *buf, int64_t len) {
+	int fd = ((int*)os_handle)[0];
+
+	while (true) {
+		ssize_t res = pread(fd, buf, len, offset);
+		if (res >= 0 || errno != EINTR)
+			return (int64_t)res;
+	}
+}
+
+char *File::map_range(int64_t offset, int64_t len) {
+	int fd = ((int*)os_handle)[0];
+
+	void *ptr = mmap(nullptr, len, PROT_READ, MAP_SHARED, fd, offset);
+	return ptr != MAP_FAILED ? (char*)ptr : nullptr;
+}
+
+void File::unmap_range(char *ptr, int64_t len) {
+	munmap(ptr, len);
+}
+
+static void advise_mapping(char *ptr, int64_t offset, int64_t len, int advice) {
+	static int64_t page_size = (int64_t)sysconf(_SC_PAGESIZE);
+
+	int64_t lo = offset & ~(page_size - 1);
+	int64_t hi = offset + len;
+
+#ifdef MADV_COLD
+	int cold = MADV_COLD;
+#else
+	int cold = MADV_DONTNEED;
+#endif
+
+	madvise(ptr + lo, hi - lo, advice == ADVISE_WILLNEED ? MADV_WILLNEED : cold);
+}
+
+void File::advise(int64_t offset, int64_t len, int advice) {
+	if (data) {
+		advise_mapping(data, offset, len, advice);
+		return;
+	}
+
+	// Windows that aren't mapped yet can still be read ahead into the page cache
+	if (advice == ADVISE_WILLNEED) {
+		int fd = ((int*)os_handle)[0];
+		posix_fadvise(fd, offset, len, POSIX_FADV_WILLNEED);
+		return;
+	}
+
+	for (int i = 0; i < n_windows; i++) {
+		Mapped_Window& w = windows[i];
+		int64_t lo = offset > w.start ? offset : w.start;
+		int64_t hi = offset + len < w.start + w.len ? offset + len : w.start + w.len;
+
+		if (hi > lo)
+			advise_mapping(w.ptr, lo - w.start, hi - lo, advice);
+	}
+}
+
+int File::create_output(const char *temp_path) {
+	int in_fd = ((int*)os_handle)[0];
+
+	// Keep the permissions of the file that's being replaced
+	mode_t mode = 0644;
+	struct stat st;
+	if (!stream && fstat(in_fd, &st) == 0)
+		mode = st.st_mode & 07777;
+
+	int fd = ::open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, mode);
+	((int*)save.out_handle)[0] = fd;
+	return fd < 0 ? -1 : 0;
+}
+
+int64_t File::write_output(const char *buf, int64_t len) {
+	int fd = ((int*)save.out_handle)[0];
+
+	int64_t done = 0;
+	while (done < len) {
+		ssize_t res = write(fd, &buf[done], len - done);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res <= 0)
+			return -1;
+
+		done += res;
+	}
+
+	return done;
+}
+
+// Unedited parts of the source are copied inside the kernel, without ever passing through this process.
+// copy_file_range() doesn't work across every pair of filesystems, in which case sendfile() is tried instead.
+int64_t File::copy_to_output(int64_t offset, int64_t len) {
+	if (stream || comp)
+		return 0;
+
+	int in_fd = ((int*)os_handle)[0];
+	int out_fd = ((int*)save.out_handle)[0];
+
+	while (save.kernel_copy > 0) {
+		off_t off = offset;
+		ssize_t res;
+
+		if (save.kernel_copy == 2)
+			res = copy_file_range(in_fd, &off, out_fd, nullptr, len, 0);
+		else
+			res = sendfile(out_fd, in_fd, &off, len);
+
+		if (res > 0)
+			return (int64_t)res;
+		if (res < 0 && errno == EINTR)
+			continue;
+
+		save.kernel_copy--;
+	}
+
 	return 0;
 }
 
-void File::close() {
-	munmap(data, total_size);
+// The rename leaves this file's descriptor and mappings on the old copy, so the pieces that point into it stay valid
+int File::close_output(bool keep) {
+	int fd = ((int*)save.out_handle)[0];
+	if (fd < 0)
+		return -1;
+
+	int res = 0;
+	if (keep && fsync(fd) != 0)
+		res = -1;
+
+	if (::close(fd) != 0)
+		res = -1;
+
+	// If only the rename fails, the finished temporary file is kept so that nothing that was saved gets lost
+	if (keep && res == 0 && rename(save.temp_path, save.path) != 0)
+		res = -2;
+
+	if (res == -1 || !keep)
+		unlink(save.temp_path);
+
+	return res;
+}
+
+void File::close_source() {
+	if (data)
+		munmap(data, source_size);
+
+	for (int i = 0; i < n_windows; i++)
+		munmap(windows[i].ptr, windows[i].len);
+
+	data = nullptr;
+	n_windows = 0;
+	span_len = 0;
+	source_size = 0;
 
 	int fd = ((int*)os_handle)[0];
 	if (fd > 0)
 		::close(fd);
+
+	((int*)os_handle)[0] = -1;
+}
+
+char *get_cache_path(const char *name) {
+	const char *xdg = getenv("XDG_CACHE_HOME");
+	const char *home = getenv("HOME");
+
+	const char *base = xdg && xdg[0] ? xdg : home;
+	const char *sub = xdg && xdg[0] ? "/mash" : "/.cache/mash";
+	if (!base || !base[0])
+		return nullptr;
+
+	int base_len = strlen(base);
+	int sub_len = strlen(sub);
+	int name_len = strlen(name);
+
+	char *path = new char[base_len + sub_len + name_len + 2];
+	memcpy(path, base, base_len);
+	memcpy(&path[base_len], sub, sub_len + 1);
+
+	// The directories above it might not exist yet either
+	for (int i = 1; i < base_len + sub_len; i++) {
+		if (path[i] == '/') {
+			path[i] = 0;
+			mkdir(path, 0755);
+			path[i] = '/';
+		}
+	}
+
+	if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+		delete[] path;
+		return nullptr;
+	}
+
+	path[base_len + sub_len] = '/';
+	memcpy(&path[base_len + sub_len + 1], name, name_len + 1);
+	return path;
+}
+
+char *map_cache_file(const char *path, int64_t *size) {
+	int fd = ::open(path, O_RDONLY);
+	if (fd < 0)
+		return nullptr;
+
+	struct stat st;
+	void *ptr = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && st.st_size > 0)
+		ptr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+	::close(fd);
+
+	if (ptr == MAP_FAILED)
+		return nullptr;
+
+	*size = (int64_t)st.st_size;
+	return (char*)ptr;
+}
+
+void unmap_cache_file(char *ptr, int64_t size) {
+	munmap(ptr, size);
 }
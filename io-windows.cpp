@@ -1,12 +1,28 @@
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include "view.h"
 
-int File::open(const char *name) {
+int File::open_source(const char *name) {
 	HANDLE *handles = (HANDLE*)&os_handle[0];
 	handles[0] = handles[1] = nullptr;
 
+	data = nullptr;
+	n_windows = 0;
+	span_len = 0;
+
+	if (!strcmp(name, "-")) {
+		// Keep our own handle, so that closing the file doesn't close stdin
+		DuplicateHandle(GetCurrentProcess(), GetStdHandle(STD_INPUT_HANDLE), GetCurrentProcess(), &handles[0], 0, FALSE, DUPLICATE_SAME_ACCESS);
+		if (!handles[0])
+			return -1;
+
+		open_stream();
+		return 0;
+	}
+
 	handles[0] = CreateFileA(
 		name,
 		GENERIC_READ,
@@ -16,34 +32,272 @@ int File::open(const char *name) {
 		FILE_ATTRIBUTE_NORMAL,
 		nullptr
 	);
-	if (!handles[0])
+	if (handles[0] == INVALID_HANDLE_VALUE) {
+		handles[0] = nullptr;
 		return -1;
+	}
+
+	// Named pipes and character devices get read in the background instead of being mapped
+	if (GetFileType(handles[0]) != FILE_TYPE_DISK) {
+		open_stream();
+		return 0;
+	}
+
+	// Compressed files are decompressed on demand instead of being mapped
+	if (open_compressed() > 0)
+		return 0;
 
 	BY_HANDLE_FILE_INFORMATION info = {0};
 	GetFileInformationByHandle(handles[0], &info);
-	total_size = (int64_t)info.nFileSizeHigh << 32LL | (int64_t)info.nFileSizeLow;
+	source_size = (int64_t)info.nFileSizeHigh << 32LL | (int64_t)info.nFileSizeLow;
+
+	total_size = source_size;
+	if (source_size == 0)
+		return 0;
 
 	handles[1] = CreateFileMapping(handles[0], NULL, PAGE_READONLY, 0, 0, NULL);
 	if (!handles[1])
 		return -2;
 
-	data = (char*)MapViewOfFile(handles[1], FILE_MAP_READ, 0, 0, 0);
-	if (!data)
-		return -3;
+	if (source_size <= FILE_WHOLE_MAP_LIMIT) {
+		// If mapping the whole file fails, fall back to mapping it in windows
+		data = (char*)MapViewOfFile(handles[1], FILE_MAP_READ, 0, 0, 0);
+	}
 
 	return 0;
 }
 
-void File::close() {
+// Maps the file again after it changed size. Returns 1 if the size was different.
+int File::refresh_mapping(int64_t new_size) {
 	HANDLE *handles = (HANDLE*)&os_handle[0];
 
+	if (new_size == source_size)
+		return 0;
+
+	// A file mapping object can't change size, so it gets replaced along with every view of it.
+	// The index worker maps its own views from the same object, so it has to be stopped first.
+	lines.stop();
+
 	if (data)
 		UnmapViewOfFile(data);
+	for (int i = 0; i < n_windows; i++)
+		UnmapViewOfFile(windows[i].ptr);
+	if (handles[1])
+		CloseHandle(handles[1]);
+
+	data = nullptr;
+	n_windows = 0;
+	span_len = 0;
+	source_size = new_size;
+	handles[1] = nullptr;
+
+	// Empty files can't be mapped at all
+	if (source_size == 0)
+		return 1;
+
+	handles[1] = CreateFileMapping(handles[0], NULL, PAGE_READONLY, 0, 0, NULL);
+	if (!handles[1])
+		return -2;
+
+	if (source_size <= FILE_WHOLE_MAP_LIMIT)
+		data = (char*)MapViewOfFile(handles[1], FILE_MAP_READ, 0, 0, 0);
+
+	return 1;
+}
+
+int File::stat_source(File_Stat *st, bool at_path) {
+	HANDLE *handles = (HANDLE*)&os_handle[0];
+	HANDLE h = handles[0];
+
+	// Finding out what the path points to now means opening it, without asking for any access to its contents
+	if (at_path) {
+		h = CreateFileA(path, 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (h == INVALID_HANDLE_VALUE)
+			return -1;
+	}
+
+	BY_HANDLE_FILE_INFORMATION info = {0};
+	BOOL ok = GetFileInformationByHandle(h, &info);
+
+	if (at_path)
+		CloseHandle(h);
+
+	if (!ok)
+		return -1;
+
+	st->dev = (uint64_t)info.dwVolumeSerialNumber;
+	st->ino = (uint64_t)info.nFileIndexHigh << 32 | (uint64_t)info.nFileIndexLow;
+	st->size = (int64_t)info.nFileSizeHigh << 32LL | (int64_t)info.nFileSizeLow;
+	st->mtime = (int64_t)info.ftLastWriteTime.dwHighDateTime << 32LL | (int64_t)info.ftLastWriteTime.dwLowDateTime;
+	return 0;
+}
+
+int64_t File::read_input(char *buf, int64_t len) {
+	HANDLE *handles = (HANDLE*)&os_handle[0];
+
+	DWORD n_read = 0;
+	if (!ReadFile(handles[0], buf, (DWORD)len, &n_read, nullptr))
+		return -1;
+
+	return (int64_t)n_read;
+}
+
+int64_t File::read_at(int64_t offset, char *buf, int64_t len) {
+	HANDLE *handles = (HANDLE*)&os_handle[0];
+
+	OVERLAPPED ov = {0};
+	ov.Offset = (DWORD)offset;
+	ov.OffsetHigh = (DWORD)(offset >> 32);
+
+	DWORD n_read = 0;
+	if (!ReadFile(handles[0], buf, (DWORD)len, &n_read, &ov))
+		return GetLastError() == ERROR_HANDLE_EOF ? 0 : -1;
+
+	return (int64_t)n_read;
+}
+
+char *File::map_range(int64_t offset, int64_t len) {
+	HANDLE *handles = (HANDLE*)&os_handle[0];
+	if (!handles[1])
+		return nullptr;
+
+	return (char*)MapViewOfFile(handles[1], FILE_MAP_READ, (DWORD)(offset >> 32), (DWORD)offset, (SIZE_T)len);
+}
+
+void File::unmap_range(char *ptr, int64_t len) {
+	UnmapViewOfFile(ptr);
+}
+
+void File::advise(int64_t offset, int64_t len, int advice) {
+	// There's no equivalent of MADV_COLD for mapped files, so only prefetching is done here
+	if (!data || advice != ADVISE_WILLNEED)
+		return;
+
+	WIN32_MEMORY_RANGE_ENTRY range = {
+		.VirtualAddress = &data[offset],
+		.NumberOfBytes = (SIZE_T)len
+	};
+	PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+}
+
+int File::create_output(const char *temp_path) {
+	HANDLE *out = (HANDLE*)&save.out_handle[0];
+
+	*out = CreateFileA(temp_path, GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (*out == INVALID_HANDLE_VALUE) {
+		*out = nullptr;
+		return -1;
+	}
+
+	return 0;
+}
+
+int64_t File::write_output(const char *buf, int64_t len) {
+	HANDLE *out = (HANDLE*)&save.out_handle[0];
+
+	DWORD n_written = 0;
+	if (!WriteFile(*out, buf, (DWORD)len, &n_written, nullptr) || n_written == 0)
+		return -1;
+
+	return (int64_t)n_written;
+}
+
+// There's no way to copy between two open handles without reading through a buffer, so this always falls back to read_source()
+int64_t File::copy_to_output(int64_t offset, int64_t len) {
+	return 0;
+}
+
+int File::close_output(bool keep) {
+	HANDLE *out = (HANDLE*)&save.out_handle[0];
+	if (!*out)
+		return -1;
+
+	int res = 0;
+	if (keep && !FlushFileBuffers(*out))
+		res = -1;
+
+	CloseHandle(*out);
+	*out = nullptr;
+
+	// Windows won't replace a file that's still mapped, including by this process.
+	// The finished temporary file is kept in that case, so nothing that was saved gets lost.
+	if (keep && res == 0 && !MoveFileExA(save.temp_path, save.path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+		res = -2;
+
+	if (res == -1 || !keep)
+		DeleteFileA(save.temp_path);
+
+	return res;
+}
+
+void File::close_source() {
+	HANDLE *handles = (HANDLE*)&os_handle[0];
+
+	if (data)
+		UnmapViewOfFile(data);
+
+	for (int i = 0; i < n_windows; i++)
+		UnmapViewOfFile(windows[i].ptr);
+
 	if (handles[0])
 		CloseHandle(handles[0]);
 	if (handles[1])
 		CloseHandle(handles[1]);
 
 	data = nullptr;
+	n_windows = 0;
+	span_len = 0;
+	source_size = 0;
 	handles[0] = handles[1] = nullptr;
-}
\ No newline at end of file
+}
+
+char *get_cache_path(const char *name) {
+	const char *base = getenv("LOCALAPPDATA");
+	if (!base || !base[0])
+		return nullptr;
+
+	int base_len = strlen(base);
+	int name_len = strlen(name);
+
+	char *path = new char[base_len + name_len + 8];
+	memcpy(path, base, base_len);
+	memcpy(&path[base_len], "\\mash", 6);
+
+	if (!CreateDirectoryA(path, nullptr) && GetLastError() != ERROR_ALREADY_EXISTS) {
+		delete[] path;
+		return nullptr;
+	}
+
+	path[base_len + 5] = '\\';
+	memcpy(&path[base_len + 6], name, name_len + 1);
+	return path;
+}
+
+// The view keeps the mapping alive once it's made, so both handles can be closed straight away
+char *map_cache_file(const char *path, int64_t *size) {
+	HANDLE fh = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (fh == INVALID_HANDLE_VALUE)
+		return nullptr;
+
+	char *ptr = nullptr;
+	LARGE_INTEGER li;
+
+	if (GetFileSizeEx(fh, &li) && li.QuadPart > 0) {
+		HANDLE mh = CreateFileMappingA(fh, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (mh) {
+			ptr = (char*)MapViewOfFile(mh, FILE_MAP_READ, 0, 0, 0);
+			CloseHandle(mh);
+		}
+	}
+
+	CloseHandle(fh);
+
+	if (ptr)
+		*size = (int64_t)li.QuadPart;
+
+	return ptr;
+}
+
+void unmap_cache_file(char *ptr, int64_t size) {
+	UnmapViewOfFile(ptr);
+}
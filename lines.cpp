@@ -0,0 +1,532 @@
+#include <stdint.h>
+#include <string.h>
+#include "view.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+#define SCAN_CHUNK_SIZE FILE_CHUNK_SIZE
+#define SCAN_BATCH_SIZE 4096
+
+// How many indexed line starts in a row have to still be line starts before a file that changed is trusted up to there
+#define MISMATCH_RUN 4
+
+struct Newline_Batch {
+	int64_t *buf;
+	int n;
+	Line_Index *index;
+	int64_t scanned;
+	int64_t line;
+	int64_t stride_mask;
+
+	void flush() {
+		std::lock_guard<std::mutex> lock(index->mtx);
+
+		int head = index->offsets.size;
+		index->offsets.resize(head + n);
+		memcpy(&index->offsets.data[head], buf, n * sizeof(int64_t));
+		index->scanned = scanned;
+		index->n_lines = line;
+		n = 0;
+
+		Vector<int64_t>& offsets = index->offsets;
+
+		while (offsets.size > 1 && (int64_t)offsets.size * (int64_t)sizeof(int64_t) > index->max_bytes) {
+			int half = (offsets.size + 1) / 2;
+			for (int i = 1; i < half; i++)
+				offsets.data[i] = offsets.data[i * 2];
+
+			offsets.resize(half);
+			index->stride *= 2;
+		}
+
+		stride_mask = index->stride - 1;
+	}
+
+	void add(int64_t offset) {
+		line++;
+		if (line & stride_mask)
+			return;
+
+		buf[n++] = offset;
+		if (n == SCAN_BATCH_SIZE)
+			flush();
+	}
+};
+
+// Each of these adds the offset just past every newline in p[0..len), where p sits at 'base' in the file
+
+static void collect_newlines_scalar(const char *p, int64_t len, int64_t base, Newline_Batch& batch) {
+	for (int64_t i = 0; i < len; i++) {
+		if (p[i] == '\n')
+			batch.add(base + i + 1);
+	}
+}
+
+#ifdef SCAN_X86
+
+static void collect_newlines_sse2(const char *p, int64_t len, int64_t base, Newline_Batch& batch) {
+	const __m128i nl = _mm_set1_epi8('\n');
+	int64_t i = 0;
+
+	for ( ; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)&p[i]);
+		uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+
+		while (mask) {
+			batch.add(base + i + __builtin_ctz(mask) + 1);
+			mask &= mask - 1;
+		}
+	}
+
+	collect_newlines_scalar(&p[i], len - i, base + i, batch);
+}
+
+__attribute__((target("avx2")))
+static void collect_newlines_avx2(const char *p, int64_t len, int64_t base, Newline_Batch& batch) {
+	const __m256i nl = _mm256_set1_epi8('\n');
+	int64_t i = 0;
+
+	for ( ; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i*)&p[i]);
+		uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+
+		while (mask) {
+			batch.add(base + i + __builtin_ctz(mask) + 1);
+			mask &= mask - 1;
+		}
+	}
+
+	collect_newlines_scalar(&p[i], len - i, base + i, batch);
+}
+
+#endif
+
+typedef void (*Collect_Func)(const char*, int64_t, int64_t, Newline_Batch&);
+
+static Collect_Func pick_collect_func() {
+#ifdef SCAN_X86
+	if (__builtin_cpu_supports("avx2"))
+		return collect_newlines_avx2;
+
+	return collect_newlines_sse2;
+#else
+	return collect_newlines_scalar;
+#endif
+}
+
+// Counts newlines in p[0..len), stopping once n have been found.
+// *last is set to the index just past the last newline found, if there were any.
+static int64_t scan_newlines(const char *p, int64_t len, int64_t n, int64_t *last) {
+	int64_t count = 0;
+	int64_t i = 0;
+
+#ifdef SCAN_X86
+	const __m128i nl = _mm_set1_epi8('\n');
+
+	while (count < n && i + 16 <= len) {
+		__m128i v = _mm_loadu_si128((const __m128i*)&p[i]);
+		uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+
+		int bits = __builtin_popcount(mask);
+		if (count + bits < n) {
+			if (mask)
+				*last = i + (31 - __builtin_clz(mask)) + 1;
+
+			count += bits;
+			i += 16;
+			continue;
+		}
+
+		while (count < n) {
+			*last = i + __builtin_ctz(mask) + 1;
+			mask &= mask - 1;
+			count++;
+		}
+		return count;
+	}
+#endif
+
+	for ( ; count < n && i < len; i++) {
+		if (p[i] == '\n') {
+			*last = i + 1;
+			count++;
+		}
+	}
+
+	return count;
+}
+
+int64_t count_newlines(const char *p, int64_t len) {
+	int64_t last;
+	return scan_newlines(p, len, INT64_MAX, &last);
+}
+
+// Reads either the edited text or the unedited source
+static const char *get_text(File *file, bool source, int64_t offset, int64_t *avail) {
+	if (!source)
+		return file->get_span(offset, avail);
+
+	int64_t start, len;
+	const char *p = file->get_source_block(offset, &start, &len);
+	if (!p) {
+		*avail = 0;
+		return nullptr;
+	}
+
+	*avail = start + len - offset;
+	return &p[offset - start];
+}
+
+// Finds the start of the line that comes n lines after the line containing 'from'.
+// Stops early at 'end', in which case the number of lines actually skipped is less than n.
+static int64_t skip_lines_forward(File *file, bool source, int64_t from, int64_t end, int64_t n, int64_t *skipped) {
+	int64_t line_start = from;
+	int64_t count = 0;
+	int64_t i = from;
+
+	while (count < n && i < end) {
+		int64_t avail;
+		const char *p = get_text(file, source, i, &avail);
+		if (!p)
+			break;
+
+		if (avail > end - i)
+			avail = end - i;
+
+		int64_t last = -1;
+		count += scan_newlines(p, avail, n - count, &last);
+		if (last >= 0)
+			line_start = i + last;
+
+		i += avail;
+	}
+
+	*skipped = count;
+	return line_start;
+}
+
+// Finds the start of the line that comes n lines before the line containing 'from'
+static int64_t skip_lines_backward(File *file, int64_t from, int64_t n, int64_t *skipped) {
+	int64_t count = -1;
+	int64_t off = from;
+
+	while (off > 0) {
+		if (file->at(off-1) == '\n') {
+			count++;
+			if (count == n)
+				break;
+		}
+		off--;
+	}
+
+	// Reaching the start of the file counts as finding the start of a line
+	*skipped = off > 0 ? count : count + 1;
+	return off;
+}
+
+void Line_Index::build_async(File *file, int64_t budget) {
+	stop();
+
+	offsets.resize(1);
+	offsets.data[0] = 0;
+	stride = 1;
+	max_bytes = budget;
+	n_lines = 0;
+	scanned = 0;
+	target = 0;
+	complete = false;
+
+	extend(file, file->source_size);
+}
+
+// Makes sure the index covers the file up to 'size', only scanning what hasn't been scanned already
+void Line_Index::extend(File *file, int64_t size) {
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+
+		target = size;
+		if (scanned < target)
+			complete = false;
+
+		if (running || complete)
+			return;
+
+		running = true;
+	}
+
+	if (worker.joinable())
+		worker.join();
+
+	cancel = false;
+	worker = std::thread([this, file]() { scan(file); });
+}
+
+void Line_Index::scan(File *file) {
+	Collect_Func collect = pick_collect_func();
+
+	int64_t buf[SCAN_BATCH_SIZE];
+	Newline_Batch batch = {
+		.buf = buf,
+		.n = 0,
+		.index = this
+	};
+
+	int64_t off, end;
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		batch.scanned = scanned;
+		batch.line = n_lines;
+		batch.stride_mask = stride - 1;
+		off = scanned;
+		end = target;
+	}
+
+	while (!cancel) {
+		if (off >= end) {
+			std::lock_guard<std::mutex> lock(mtx);
+			if (target > end) {
+				end = target;
+				continue;
+			}
+
+			// Cleared under the same lock, so that an extend() from now on starts a new worker instead of counting on this one
+			complete = true;
+			running = false;
+			return;
+		}
+
+		// Chunks are mapped from an aligned offset, even if scanning resumes part way through one
+		int64_t base = off & ~(int64_t)(SCAN_CHUNK_SIZE - 1);
+		int64_t chunk_end = base + SCAN_CHUNK_SIZE < end ? base + SCAN_CHUNK_SIZE : end;
+
+		const char *data = file->acquire_range(base, chunk_end - base);
+		if (!data)
+			break;
+
+		collect(&data[off - base], chunk_end - off, off, batch);
+		file->release_range(data, chunk_end - base);
+
+		batch.scanned = chunk_end;
+		batch.flush();
+
+		off = chunk_end;
+	}
+
+	// Cancelled, or the range couldn't be read
+	std::lock_guard<std::mutex> lock(mtx);
+	running = false;
+}
+
+// Forgets everything that was indexed from 'offset' onwards, so that extend() scans it again. The worker has to be stopped first.
+void Line_Index::truncate(int64_t offset) {
+	std::lock_guard<std::mutex> lock(mtx);
+
+	if (offset >= scanned || offsets.size <= 0)
+		return;
+
+	int64_t lo = 0;
+	int64_t hi = offsets.size;
+	while (hi - lo > 1) {
+		int64_t mid = lo + (hi - lo) / 2;
+		if (offsets.data[mid] <= offset)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	offsets.resize(lo + 1);
+	n_lines = lo * stride;
+	scanned = offsets.data[lo];
+	complete = false;
+}
+
+// Finds how much of the index still holds after the file changed in place, by checking that the indexed line starts below 'limit'
+// still come straight after a newline. This assumes everything past the first change moved, which is what happens when a file
+// gets rewritten from some point onwards. Returns 'limit' if nothing below it looks different.
+int64_t Line_Index::first_mismatch(File *file, int64_t limit) {
+	std::lock_guard<std::mutex> lock(mtx);
+
+	// Any one line start could still come after a newline by chance, so a few in a row get checked
+	auto still_holds = [this, file](int64_t idx, int64_t n) {
+		for (int64_t i = idx; i < idx + MISMATCH_RUN && i < n; i++) {
+			int64_t offset = offsets.data[i];
+			char c = 0;
+			if (offset > 0 && (file->read_at(offset - 1, &c, 1) != 1 || c != '\n'))
+				return false;
+		}
+		return true;
+	};
+
+	if (offsets.size <= 1)
+		return limit;
+
+	// Only look at the entries below the limit
+	int64_t lo = 0;
+	int64_t hi = offsets.size;
+	while (hi - lo > 1) {
+		int64_t mid = lo + (hi - lo) / 2;
+		if (offsets.data[mid] <= limit)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	int64_t n = lo + 1;
+	int64_t top = n > MISMATCH_RUN ? n - MISMATCH_RUN : 0;
+	if (still_holds(top, n))
+		return limit;
+
+	hi = top;
+	lo = 0;
+	while (hi - lo > 1) {
+		int64_t mid = lo + (hi - lo) / 2;
+		if (still_holds(mid, n))
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	return offsets.data[lo];
+}
+
+void Line_Index::stop() {
+	cancel = true;
+	if (worker.joinable())
+		worker.join();
+}
+
+void Line_Index::nearest_line(int64_t line, int64_t& found_line, int64_t& found_offset) {
+	std::lock_guard<std::mutex> lock(mtx);
+
+	int64_t n = offsets.size;
+	if (n <= 0) {
+		found_line = 0;
+		found_offset = 0;
+		return;
+	}
+
+	int64_t idx = line / stride;
+	if (idx >= n)
+		idx = n - 1;
+
+	found_line = idx * stride;
+	found_offset = offsets.data[idx];
+}
+
+void Line_Index::nearest_offset(int64_t offset, int64_t& found_line, int64_t& found_offset) {
+	std::lock_guard<std::mutex> lock(mtx);
+
+	int64_t lo = 0;
+	int64_t hi = offsets.size;
+	if (hi <= 0) {
+		found_line = 0;
+		found_offset = 0;
+		return;
+	}
+
+	while (hi - lo > 1) {
+		int64_t mid = lo + (hi - lo) / 2;
+		if (offsets.data[mid] <= offset)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	found_line = lo * stride;
+	found_offset = offsets.data[lo];
+}
+
+// The hint is any known line start (usually the top of the grid), which is used instead of the index if it's closer
+int64_t File::find_line(int64_t line, int64_t hint_line, int64_t hint_offset, int64_t *found_line) {
+	if (line < 0)
+		line = 0;
+
+	int64_t idx_line, idx_offset;
+	nearest_line(line, idx_line, idx_offset);
+
+	int64_t start_line = idx_line;
+	int64_t start_offset = idx_offset;
+	int64_t skipped = 0;
+
+	if (hint_line > line && hint_line - line < line - idx_line) {
+		int64_t off = skip_lines_backward(this, hint_offset, hint_line - line, &skipped);
+		*found_line = hint_line - skipped;
+		return off;
+	}
+	if (hint_line <= line && hint_line > idx_line) {
+		start_line = hint_line;
+		start_offset = hint_offset;
+	}
+
+	int64_t off = skip_lines_forward(this, false, start_offset, total_size, line - start_line, &skipped);
+	*found_line = start_line + skipped;
+	return off;
+}
+
+int64_t File::find_line_of(int64_t offset, int64_t hint_line, int64_t hint_offset, int64_t *line_start) {
+	if (offset < 0) offset = 0;
+	if (offset > total_size) offset = total_size;
+
+	int64_t idx_line, idx_offset;
+	nearest_offset(offset, idx_line, idx_offset);
+
+	int64_t skipped = 0;
+
+	if (hint_offset > offset && hint_offset - offset < offset - idx_offset) {
+		int64_t unused;
+		skip_lines_forward(this, false, offset, hint_offset, INT64_MAX, &skipped);
+		*line_start = skip_lines_backward(this, offset, 0, &unused);
+		return hint_line - skipped;
+	}
+
+	int64_t start_line = idx_line;
+	int64_t start_offset = idx_offset;
+
+	if (hint_offset <= offset && hint_offset > idx_offset) {
+		start_line = hint_line;
+		start_offset = hint_offset;
+	}
+
+	*line_start = skip_lines_forward(this, false, start_offset, offset, INT64_MAX, &skipped);
+	return start_line + skipped;
+}
+
+void File::nearest_line(int64_t line, int64_t& found_line, int64_t& found_offset) {
+	if (!pieces.active) {
+		lines.nearest_line(line, found_line, found_offset);
+		return;
+	}
+
+	// Pieces don't have to start at the start of a line
+	pieces.nearest_line(this, line, found_line, found_offset);
+	if (found_offset > 0 && at(found_offset - 1) != '\n') {
+		int64_t unused;
+		found_offset = skip_lines_backward(this, found_offset, 0, &unused);
+	}
+}
+
+void File::nearest_offset(int64_t offset, int64_t& found_line, int64_t& found_offset) {
+	if (!pieces.active) {
+		lines.nearest_offset(offset, found_line, found_offset);
+		return;
+	}
+
+	pieces.nearest_offset(this, offset, found_line, found_offset);
+	if (found_offset > 0 && at(found_offset - 1) != '\n') {
+		int64_t unused;
+		found_offset = skip_lines_backward(this, found_offset, 0, &unused);
+	}
+}
+
+// Number of newlines before 'offset' in the unedited source
+int64_t File::source_line_of(int64_t offset) {
+	int64_t idx_line, idx_offset;
+	lines.nearest_offset(offset, idx_line, idx_offset);
+
+	int64_t skipped = 0;
+	skip_lines_forward(this, true, idx_offset, offset, INT64_MAX, &skipped);
+	return idx_line + skipped;
+}
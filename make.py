@@ -20,7 +20,7 @@ if os.name == 'nt':
 		"C:\\VulkanSDK\\1.2.135.0\\Include"
 	))
 	libs.extend(
-		("freetype", "glfw3", "vulkan-1", "kernel32", "user32", "shell32", "gdi32", "vcruntime", "msvcrt", "msvcprt", "ucrt")
+		("freetype", "glfw3", "vulkan-1", "zlib", "zstd", "kernel32", "user32", "shell32", "gdi32", "vcruntime", "msvcrt", "msvcprt", "ucrt")
 	)
 	lib_paths.extend((
 		"C:\\Users\\Jack\\source\\freetype-2.10.2\\win64",
@@ -33,11 +33,12 @@ if os.name == 'nt':
 else:
 	excludes["io-windows.cpp"] = True
 	includes.append("/usr/include/freetype2")
-	libs.extend(("freetype", "glfw", "vulkan"))
+	libs.extend(("freetype", "glfw", "vulkan", "z", "zstd", "pthread"))
 
 cpp_list = []
 for l in os.listdir("."):
-	if os.path.isfile(l) and l[-4:] == ".cpp" and l not in excludes:
+	# The *-test.cpp files are standalone programs with their own main()
+	if os.path.isfile(l) and l[-4:] == ".cpp" and l[-9:] != "-test.cpp" and l not in excludes:
 		cpp_list.append(l)
 
 include_string = ""
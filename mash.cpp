@@ -19,6 +19,8 @@ static uint32_t cursor_color = 0;
 
 static Font_Handle font_face = nullptr;
 static Font_Render font_render = {0};
+static Glyph_Cache glyph_cache = {0};
+static Glyph_Bake glyph_bake = {0};
 
 static File file = {0};
 static Grid grid = {0};
@@ -30,6 +32,38 @@ static bool was_vertical_movement = false;
 
 static bool needs_resubmit = true;
 
+// Frames only get presented when something on screen actually changed
+static Cell_Shadow cell_shadow = {0};
+static Damage frame_damage = {0};
+
+// Which rows have to be uploaded, which leaves out the ones that only moved because of scrolling
+static Damage grid_damage = {0};
+
+// When following a file, the view sticks to the end of it as long as the end is visible
+static bool follow_file = false;
+static float font_size = DEFAULT_FONT_SIZE;
+
+// Whether the glyphs are sampled from an R8 array image, or read from the glyphset buffer by hand
+static bool use_glyph_image = true;
+static int bench_frames = 0;
+
+// With --stats, how long frames take to build and submit, and how long input takes to reach vkQueuePresentKHR()
+struct Frame_Stats {
+	double input_time; // when the oldest input that hasn't been presented yet came in, or 0
+	double frame_ms;
+	double latency_ms;
+	double max_latency_ms;
+	int64_t upload_bytes;
+	int n_frames;
+	int n_inputs;
+};
+
+static bool show_stats = false;
+static Frame_Stats frame_stats = {0};
+
+static const char *file_name = "vulkan.cpp";
+static int shown_save_state = -1;
+
 const char **get_required_instance_extensions(uint32_t *n_inst_exts) {
 	return glfwGetRequiredInstanceExtensions(n_inst_exts);
 }
@@ -58,29 +92,163 @@ int64_t get_file_offset_from_thumb(Grid *g, int64_t file_size) {
 
 int upload_glyphsets(Font_Handle fh, Font_Render *renders, int n_renders) {
 	if (!vk.glyphset_pool.size) {
-		vk.glyphset_pool = vk.allocate_gpu_memory(GLYPHSET_POOL_SIZE);
+		vk.glyphset_pool = vk.allocate_gpu_memory(GLYPHSET_POOL_SIZE, false);
 		if (!vk.glyphset_pool.size)
 			return __LINE__;
 	}
 
+	// The glyphsets have been rasterized (or loaded from the cache) while Vulkan was starting up
 	renders[0].buf = vk.glyphset_pool.staging_area;
-	make_font_render(fh, renders[0]);
+	unsigned char *pixels = glyph_bake.finish();
+	memcpy(renders[0].buf, pixels, renders[0].total_size);
+	glyph_bake.destroy();
+
+	// Whatever's left of the pool after the ASCII glyphsets goes to the glyph cache
+	int n_slots = vk.glyphset_pool.size / renders[0].slot_size - N_GLYPHS;
+	if (n_slots > GLYPH_CACHE_SLOTS)
+		n_slots = GLYPH_CACHE_SLOTS;
+
+	// The image has a layer for every slot, so the glyph cache can't have more slots than the device allows layers.
+	// Glyphs with 4 bits per pixel don't fit in an R8 image, so those always come from the buffer.
+	if (renders[0].bits != 8)
+		use_glyph_image = false;
+
+	int img_w = 1, img_h = 1, layers = 1;
+	if (use_glyph_image) {
+		int max_layers = (int)vk.gpu_props.limits.maxImageArrayLayers;
+		if (N_GLYPHS + n_slots > max_layers)
+			n_slots = max_layers - N_GLYPHS;
+
+		img_w = renders[0].glyph_img_w;
+		img_h = renders[0].glyph_h;
+		layers = N_GLYPHS + n_slots;
+	}
+
+	int res = vk.create_glyph_image(img_w, img_h, layers);
+	if (res != 0)
+		return res;
+
+	glyph_cache.init(fh, renders[0], N_GLYPHS, n_slots, GLYPHS_PER_FRAME);
+
+	if (!use_glyph_image) {
+		res = vk.push_glyphs_to_image(vk.glyphset_pool, nullptr, 0, 0);
+		if (res != 0)
+			return res;
+
+		return vk.push_to_gpu(vk.glyphset_pool, 0, renders[0].total_size);
+	}
+
+	int slots[N_GLYPHS];
+	for (int i = 0; i < N_GLYPHS; i++)
+		slots[i] = i;
+
+	return vk.push_glyphs_to_image(vk.glyphset_pool, slots, N_GLYPHS, renders[0].slot_size);
+}
+
+// Uploads only the glyphs that were rasterized this frame, merging neighbouring slots into one copy
+static int upload_new_glyphs(Glyph_Cache& gc) {
+	if (gc.n_dirty <= 0)
+		return 0;
+
+	if (use_glyph_image) {
+		int res = vk.push_glyphs_to_image(vk.glyphset_pool, gc.dirty, gc.n_dirty, gc.render.slot_size);
+		gc.n_dirty = 0;
+		return res;
+	}
+
+	for (int i = 1; i < gc.n_dirty; i++) {
+		int s = gc.dirty[i];
+		int j = i;
+		for ( ; j > 0 && gc.dirty[j-1] > s; j--)
+			gc.dirty[j] = gc.dirty[j-1];
+		gc.dirty[j] = s;
+	}
 
-	return vk.push_to_gpu(vk.glyphset_pool, 0, renders[0].total_size);
+	VkDeviceSize slot_size = (VkDeviceSize)gc.render.slot_size;
+	VkBufferCopy ranges[GLYPHS_PER_FRAME];
+	int n_ranges = 0;
+
+	for (int i = 0; i < gc.n_dirty; i++) {
+		VkDeviceSize offset = (VkDeviceSize)gc.dirty[i] * slot_size;
+
+		if (n_ranges > 0 && ranges[n_ranges-1].srcOffset + ranges[n_ranges-1].size == offset) {
+			ranges[n_ranges-1].size += slot_size;
+			continue;
+		}
+
+		ranges[n_ranges++] = {
+			.srcOffset = offset,
+			.dstOffset = offset,
+			.size = slot_size
+		};
+	}
+
+	gc.n_dirty = 0;
+	return vk.push_ranges_to_gpu(vk.glyphset_pool, ranges, n_ranges);
+}
+
+// Moving the cursor or the scrollbar thumb only damages the rows they cover. Anything else about a view changing means redrawing all of it.
+static void add_param_damage(const View_Params& old, const View_Params& cur, Damage& damage) {
+	View_Params a = old;
+	View_Params b = cur;
+	a.cursor = b.cursor = {0, 0};
+	a.thumb_pos = b.thumb_pos = {0, 0};
+	a.thumb_color = b.thumb_color = 0;
+	a.grid_cell_offset = b.grid_cell_offset = 0;
+	a.grid_row_base = b.grid_row_base = 0;
+
+	if (memcmp(&a, &b, sizeof(View_Params)) != 0) {
+		damage.full = true;
+		return;
+	}
+
+	if (old.cursor.x != cur.cursor.x || old.cursor.y != cur.cursor.y) {
+		damage.add(old.cursor.y, old.cursor.y + 1);
+		damage.add(cur.cursor.y, cur.cursor.y + 1);
+	}
+
+	if (old.thumb_pos.x != cur.thumb_pos.x || old.thumb_pos.y != cur.thumb_pos.y || old.thumb_color != cur.thumb_color) {
+		int h = cur.cell_size.y;
+		damage.add(old.thumb_pos.x / h, (old.thumb_pos.x + old.thumb_pos.y) / h + 1);
+		damage.add(cur.thumb_pos.x / h, (cur.thumb_pos.x + cur.thumb_pos.y) / h + 1);
+	}
 }
 
+// Fills in frame_damage. If nothing changed, no frame slot gets used and there's nothing to render.
 int render_and_upload_views(View *views, int n_views, Font_Render *renders) {
-	if (!vk.grids_pool.size) {
-		vk.grids_pool = vk.allocate_gpu_memory(GRIDS_POOL_SIZE);
-		if (!vk.grids_pool.size)
+	View& v = views[0];
+	int grid_size = v.grid->rows * v.grid->cols * sizeof(Cell);
+
+	// The regions grow with the grid, when the window gets bigger or the text gets zoomed out
+	if (grid_size > vk.grid_region_size) {
+		if (vk.resize_grids_pool(grid_size) != 0)
+			return __LINE__;
+
+		// Cells only hold indices into the palette
+		VkBufferCopy palette_range = {
+			.srcOffset = 0,
+			.dstOffset = 0,
+			.size = GRID_PALETTE_SIZE
+		};
+		memcpy(vk.grids_pool.staging_area, v.formatter->colors, GRID_PALETTE_SIZE);
+		if (vk.push_ranges_to_gpu(vk.grids_pool, &palette_range, 1) != 0)
 			return __LINE__;
 	}
 
-	Cell *cells = (Cell*)vk.grids_pool.staging_area;
-	View& v = views[0];
-	v.grid->render_into(v.file, cells, v.formatter, input_state, vk.wnd_width, vk.wnd_height);
+	Cell *cells = cell_shadow.begin(v.grid->rows, v.grid->cols, v.grid->row_offset);
+
+	glyph_cache.begin_frame();
+	v.grid->render_into(v.file, cells, v.formatter, &glyph_cache, input_state, vk.wnd_width, vk.wnd_height);
 
-	int res = vk.push_to_gpu(vk.grids_pool, 0, v.grid->rows * v.grid->cols * sizeof(Cell));
+	grid_damage.clear();
+	int scroll = cell_shadow.diff(grid_damage);
+
+	// Everything on screen moves when scrolling though, and a glyph slot that just got reused can look different without any cell changing
+	frame_damage = grid_damage;
+	if (scroll != 0 || glyph_cache.n_dirty > 0)
+		frame_damage.full = true;
+
+	int res = upload_new_glyphs(glyph_cache);
 	if (res != 0)
 		return __LINE__;
 
@@ -95,10 +263,13 @@ int render_and_upload_views(View *views, int n_views, Font_Render *renders) {
 
 		vk.view_params = vps;
 		vk.view_param_cap = cap;
+		vk.n_view_params = 0;
 	}
-	vk.n_view_params = n_views;
 
-	for (int i = 0; i < vk.n_view_params; i++) {
+	if (n_views != vk.n_view_params)
+		frame_damage.full = true;
+
+	for (int i = 0; i < n_views; i++) {
 		Font_Render *r = &renders[views[i].font_render_idx];
 
 		int thumb_y, thumb_h;
@@ -110,10 +281,10 @@ int render_and_upload_views(View *views, int n_views, Font_Render *renders) {
 		else if (input_state.thumb_flags & 2)
 			thumb_color = v.formatter->hovered_thumb_color;
 
-		vk.view_params[i] = {
+		View_Params params = {
 			.view_origin = {0, 0},
 			.view_size = {(uint32_t)vk.wnd_width, (uint32_t)vk.wnd_height},
-			.cell_size = {(uint32_t)r->glyph_w, (uint32_t)r->glyph_h},
+			.cell_size = {(uint32_t)r->cell_w, (uint32_t)r->cell_h},
 			.thumb_pos = {(uint32_t)thumb_y, (uint32_t)thumb_h},
 			.cursor = {v.grid->rel_caret_col + v.grid->last_line_num_gap, v.grid->rel_caret_row},
 			.thumb_color = thumb_color,
@@ -123,16 +294,212 @@ int render_and_upload_views(View *views, int n_views, Font_Render *renders) {
 			.glyphset_byte_offset = 0,
 			.glyph_overlap_w = (uint32_t)r->overlap_w,
 			.glyph_full_w = (uint32_t)r->glyph_img_w,
+			.glyph_h = (uint32_t)r->glyph_h,
+			.glyph_format = (uint32_t)r->format,
+			.glyph_bits = (uint32_t)r->bits,
+			.glyph_slot_size = (uint32_t)r->slot_size,
+			.glyph_source = use_glyph_image ? GLYPH_SOURCE_IMAGE : GLYPH_SOURCE_BUFFER,
+			.glyph_scale = (float)r->glyph_h / (float)r->cell_h,
+			.grid_rows = (uint32_t)v.grid->rows,
+			.grid_row_base = 0
 		};
+
+		if (!frame_damage.full)
+			add_param_damage(vk.view_params[i], params, frame_damage);
+
+		vk.view_params[i] = params;
+	}
+	vk.n_view_params = n_views;
+
+	cell_shadow.swap();
+	if (frame_damage.empty())
+		return 0;
+
+	// Waits only if the GPU still hasn't finished the frame from FRAMES_IN_FLIGHT frames ago
+	Cell *grid_cells = (Cell*)vk.begin_frame(grid_size);
+	if (!grid_cells)
+		return __LINE__;
+
+	Frame_Slot& frame = vk.frames[vk.cur_frame];
+	int rows = v.grid->rows;
+	int row_size = v.grid->cols * sizeof(Cell);
+
+	// This slot's region is FRAMES_IN_FLIGHT frames behind, so it's also missing whatever changed in the frames the other slots hold.
+	// Going from the oldest of those to this one, the ring gets rotated by however far each of them scrolled.
+	Damage stale = {0};
+	int base = frame.ring_base;
+	for (int i = 1; i < FRAMES_IN_FLIGHT; i++) {
+		Frame_Slot& f = vk.frames[(vk.cur_frame + i) % FRAMES_IN_FLIGHT];
+		stale.shift(f.scroll, rows);
+		stale.merge(f.damage);
+		base += f.scroll;
+	}
+	stale.shift(scroll, rows);
+	stale.merge(grid_damage);
+	base += scroll;
+
+	frame.damage = grid_damage;
+	frame.scroll = scroll;
+
+	if (stale.full || rows == 0) {
+		stale.ranges[0] = {0, rows};
+		stale.n_ranges = 1;
+		base = 0;
+	}
+	else {
+		base = ((base % rows) + rows) % rows;
+	}
+	frame.ring_base = base;
+
+	// Only those rows get written, and the copies to the device are recorded into this frame's command buffer
+	for (int i = 0; i < stale.n_ranges; i++) {
+		int start = stale.ranges[i].start > 0 ? stale.ranges[i].start : 0;
+		int end = stale.ranges[i].end < rows ? stale.ranges[i].end : rows;
+		int at = rows > 0 ? (start + base) % rows : 0;
+
+		while (start < end) {
+			int n = end - start < rows - at ? end - start : rows - at;
+			int offset = at * row_size;
+			int len = n * row_size;
+			memcpy((uint8_t*)grid_cells + offset, (uint8_t*)&cell_shadow.prev[start * v.grid->cols], len);
+
+			frame.grid_copies[frame.n_grid_copies++] = {
+				.srcOffset = (VkDeviceSize)(frame.grid_offset + offset),
+				.dstOffset = (VkDeviceSize)(frame.grid_offset + offset),
+				.size = (VkDeviceSize)len
+			};
+			frame_stats.upload_bytes += len;
+
+			start += n;
+			at = 0;
+		}
+	}
+
+	for (int i = 0; i < n_views; i++) {
+		vk.view_params[i].grid_cell_offset = (uint32_t)(frame.grid_offset / sizeof(Cell));
+		vk.view_params[i].grid_row_base = (uint32_t)base;
+	}
+
+	// Only the rows that changed need to reach the screen, if the driver can be told that
+	vk.n_damage_rects = 0;
+	if (!frame_damage.full) {
+		int cell_h = renders[v.font_render_idx].cell_h;
+
+		for (int i = 0; i < frame_damage.n_ranges; i++) {
+			int y0 = frame_damage.ranges[i].start * cell_h;
+			int y1 = frame_damage.ranges[i].end * cell_h;
+			y1 = y1 < vk.wnd_height ? y1 : vk.wnd_height;
+			if (y1 <= y0)
+				continue;
+
+			vk.damage_rects[vk.n_damage_rects++] = {
+				.offset = {0, y0},
+				.extent = {(uint32_t)vk.wnd_width, (uint32_t)(y1 - y0)},
+				.layer = 0
+			};
+		}
+	}
+
+	return 0;
+}
+
+// Shows how far along a save is in the window title
+static void update_title(GLFWwindow *window) {
+	int state = file.save.result;
+	if (file.save.running && file.save.total > 0)
+		state = 2 + (int)(file.save.written * 100 / file.save.total);
+
+	if (state == shown_save_state)
+		return;
+
+	shown_save_state = state;
+
+	char title[64];
+	if (state >= 2)
+		snprintf(title, sizeof(title), "Mash - saving %d%%", state - 2);
+	else if (state == 1)
+		snprintf(title, sizeof(title), "Mash - saved");
+	else if (state < 0)
+		snprintf(title, sizeof(title), "Mash - save failed (%d)", state);
+	else
+		snprintf(title, sizeof(title), "Mash");
+
+	glfwSetWindowTitle(window, title);
+}
+
+static void mark_input() {
+	if (frame_stats.input_time == 0.0)
+		frame_stats.input_time = glfwGetTime();
+}
+
+static void record_frame(double start) {
+	double now = glfwGetTime();
+	frame_stats.frame_ms += (now - start) * 1000.0;
+	frame_stats.n_frames++;
+
+	if (frame_stats.input_time > 0.0) {
+		double ms = (now - frame_stats.input_time) * 1000.0;
+		frame_stats.latency_ms += ms;
+		frame_stats.max_latency_ms = ms > frame_stats.max_latency_ms ? ms : frame_stats.max_latency_ms;
+		frame_stats.n_inputs++;
+		frame_stats.input_time = 0.0;
+	}
+}
+
+static void print_frame_stats() {
+	Frame_Stats& st = frame_stats;
+	printf("%s, %d swapchain images: %d frames, %.3f ms/frame to build and submit, %.1f KiB of cells uploaded per frame",
+		present_mode_name(vk.present_mode), vk.n_swap_images, st.n_frames, st.n_frames ? st.frame_ms / st.n_frames : 0.0,
+		st.n_frames ? (double)st.upload_bytes / 1024.0 / st.n_frames : 0.0);
+
+	if (st.n_inputs > 0)
+		printf(", input to present %.3f ms on average (max %.3f)", st.latency_ms / st.n_inputs, st.max_latency_ms);
+
+	printf("\n");
+}
+
+// Draws the same frame over and over, then prints how long the GPU and the whole frame took on average
+static int run_benchmark(int n_frames) {
+	double gpu_total = 0.0;
+	double gpu_min = 1e9;
+	int n_timed = 0;
+
+	double start = glfwGetTime();
+
+	for (int i = 0; i < n_frames; i++) {
+		int res = vk.render();
+		if (res != 0)
+			return res;
+
+		double ms = vk.last_frame_gpu_ms();
+		if (ms >= 0.0) {
+			gpu_total += ms;
+			gpu_min = ms < gpu_min ? ms : gpu_min;
+			n_timed++;
+		}
 	}
 
+	double wall_ms = (glfwGetTime() - start) * 1000.0 / (double)n_frames;
+	const char *path = use_glyph_image ? "image" : "buffer";
+	const char *mode = present_mode_name(vk.present_mode);
+
+	if (n_timed > 0)
+		printf("%s glyphs, %s, %dx%d: GPU %.3f ms/frame (min %.3f), %.3f ms/frame overall\n", path, mode, vk.wnd_width, vk.wnd_height, gpu_total / n_timed, gpu_min, wall_ms);
+	else
+		printf("%s glyphs, %s, %dx%d: %.3f ms/frame overall (no GPU timestamps)\n", path, mode, vk.wnd_width, vk.wnd_height, wall_ms);
+
+	Gpu_Stats mem = vk.get_memory_stats();
+	printf("GPU memory: %.1f of %.1f MiB used by %d allocations in %d blocks, %d free ranges (largest %.1f MiB)%s\n",
+		(double)mem.used / MiB, (double)mem.reserved / MiB, mem.n_allocs, mem.n_blocks, mem.n_free_ranges, (double)mem.largest_free / MiB,
+		vk.grids_pool.direct ? ", grids written directly" : "");
+
 	return 0;
 }
 
 int start_app(GLFWwindow *window) {
 	auto resize_grid = [](Grid& g) {
-		g.rows = (vk.wnd_height + font_render.glyph_h - 1) / font_render.glyph_h;
-		g.cols = (vk.wnd_width + font_render.glyph_w - 1) / font_render.glyph_w;
+		g.rows = (vk.wnd_height + font_render.cell_h - 1) / font_render.cell_h;
+		g.cols = (vk.wnd_width + font_render.cell_w - 1) / font_render.cell_w;
 	};
 	resize_grid(grid);
 
@@ -155,35 +522,83 @@ int start_app(GLFWwindow *window) {
 	res = vk.construct_pipeline();
 	if (res != 0) return res;
 
+	if (bench_frames > 0)
+		return run_benchmark(bench_frames);
+
+	// The frame made above was never presented
 	needs_resubmit = true;
+	cell_shadow.invalidate();
+
+	double last_watch_time = glfwGetTime();
 
 	while (!glfwWindowShouldClose(window)) {
 		glfwWaitEventsTimeout(0.5);
 
+		update_title(window);
+
+		double now = glfwGetTime();
+		if (follow_file || file.stream || file.comp || now - last_watch_time >= WATCH_INTERVAL_SECS) {
+			last_watch_time = now;
+			bool pinned = follow_file && grid.end_grid_offset >= file.total_size;
+
+			int changed = file.refresh();
+			if (changed == REFRESH_CHANGED)
+				grid.restore_view(&file);
+
+			if (changed > 0) {
+				if (pinned)
+					grid.jump_to_offset(&file, file.total_size, 0);
+
+				needs_resubmit = true;
+			}
+		}
+
 		int w, h;
 		glfwGetFramebufferSize(window, &w, &h);
 		if (w != vk.wnd_width || h != vk.wnd_height) {
 			vk.recreate_swapchain(w, h);
+			cell_shadow.invalidate();
 			needs_resubmit = true;
 		}
 
+		// Input that didn't change anything doesn't count towards latency
+		if (!needs_resubmit)
+			frame_stats.input_time = 0.0;
+
+		double frame_start = glfwGetTime();
+		bool new_frame = needs_resubmit;
+
 		if (needs_resubmit) {
 			resize_grid(grid);
 
 			res = render_and_upload_views(&view, 1, &font_render);
 			if (res != 0) return res;
 
-			res = vk.update_command_buffers();
-			if (res != 0) return res;
-
 			needs_resubmit = false;
 
+			// Glyphs that didn't get rasterized in time get another go on the next frame, straight away.
+			// Glyphs that had no slot to go into because the whole cache is on screen don't, since the next frame would be the same.
+			if (glyph_cache.deferred) {
+				needs_resubmit = true;
+				glfwPostEmptyEvent();
+			}
+
 			input_state.advance();
 		}
 
-		res = vk.render();
+		// Nothing gets acquired, submitted or presented unless something changed
+		if (new_frame && !frame_damage.empty()) {
+			res = vk.render();
+			record_frame(frame_start);
+		}
+		else if (new_frame) {
+			frame_stats.input_time = 0.0;
+		}
 	}
 
+	if (show_stats)
+		print_frame_stats();
+
 	return res;
 }
 
@@ -192,11 +607,14 @@ int start_app(GLFWwindow *window) {
 
 // This function **doesn't** get called from a different thread, so we can let it access globals
 static void key_callback(GLFWwindow *window, int key, int scancode, int action, int mods) {
+	mark_input();
+
 	bool is_action = true;
 	bool vertical = false;
 	int dir = 0;
 
 	bool shift_held = glfwGetKey(window, GLFW_KEY_LEFT_SHIFT) == GLFW_PRESS || glfwGetKey(window, GLFW_KEY_RIGHT_SHIFT) == GLFW_PRESS;
+	bool ctrl_held = (mods & GLFW_MOD_CONTROL) != 0;
 	input_state.mod_flags = shift_held ? 1 : 0;
 
 	if (action == GLFW_PRESS || action == GLFW_REPEAT) {
@@ -222,6 +640,37 @@ static void key_callback(GLFWwindow *window, int key, int scancode, int action,
 			grid.adjust_offsets(&file, grid.rows, 0);
 			is_action = false;
 		}
+		else if (key == GLFW_KEY_ENTER || key == GLFW_KEY_KP_ENTER) {
+			grid.insert_text(&file, "\n", 1);
+			was_vertical_movement = false;
+			is_action = false;
+		}
+		else if (key == GLFW_KEY_TAB) {
+			grid.insert_text(&file, "\t", 1);
+			was_vertical_movement = false;
+			is_action = false;
+		}
+		else if (key == GLFW_KEY_BACKSPACE) {
+			grid.erase(&file, -1);
+			was_vertical_movement = false;
+			is_action = false;
+		}
+		else if (key == GLFW_KEY_DELETE) {
+			grid.erase(&file, 1);
+			was_vertical_movement = false;
+			is_action = false;
+		}
+		else if (ctrl_held && key == GLFW_KEY_S) {
+			// Pipes and compressed files don't have anywhere sensible to be saved back to
+			if (!file.stream && !file.comp)
+				file.save_as(file_name);
+			is_action = false;
+		}
+		else if (ctrl_held && (key == GLFW_KEY_Z || key == GLFW_KEY_Y)) {
+			grid.undo(&file, key == GLFW_KEY_Y || shift_held);
+			was_vertical_movement = false;
+			is_action = false;
+		}
 		else
 			is_action = false;
 	}
@@ -238,16 +687,17 @@ static void key_callback(GLFWwindow *window, int key, int scancode, int action,
 			grid.move_cursor_vertically(&file, dir, grid.target_column);
 		}
 		else {
-			int64_t cur = grid.primary_cursor + (int64_t)dir;
-			if (cur < 0) cur = 0;
-			if (cur > file.total_size) cur = file.total_size;
-			grid.primary_cursor = cur;
+			int64_t cur = grid.primary_cursor;
+			grid.primary_cursor = dir > 0 ? file.next_char(cur) : file.prev_char(cur);
 		}
 	}
 
 	if (is_action) {
 		grid.primary_cursor = grid.jump_to_offset(&file, grid.primary_cursor, JUMP_FLAG_AFFECT_COLUMN);
 
+		// Moving the cursor ends the current run of typing as far as undo is concerned
+		file.journal.seal();
+
 		if (!vertical || dir == 0)
 			was_vertical_movement = false;
 
@@ -258,10 +708,58 @@ static void key_callback(GLFWwindow *window, int key, int scancode, int action,
 	needs_resubmit = true;
 }
 
+static void char_callback(GLFWwindow *window, unsigned int codepoint) {
+	mark_input();
+
+	char buf[4];
+	int len = 0;
+
+	if (codepoint < 0x80) {
+		buf[len++] = (char)codepoint;
+	}
+	else if (codepoint < 0x800) {
+		buf[len++] = (char)(0xc0 | (codepoint >> 6));
+		buf[len++] = (char)(0x80 | (codepoint & 0x3f));
+	}
+	else if (codepoint < 0x10000) {
+		buf[len++] = (char)(0xe0 | (codepoint >> 12));
+		buf[len++] = (char)(0x80 | ((codepoint >> 6) & 0x3f));
+		buf[len++] = (char)(0x80 | (codepoint & 0x3f));
+	}
+	else {
+		buf[len++] = (char)(0xf0 | (codepoint >> 18));
+		buf[len++] = (char)(0x80 | ((codepoint >> 12) & 0x3f));
+		buf[len++] = (char)(0x80 | ((codepoint >> 6) & 0x3f));
+		buf[len++] = (char)(0x80 | (codepoint & 0x3f));
+	}
+
+	grid.insert_text(&file, buf, len);
+	was_vertical_movement = false;
+
+	needs_resubmit = true;
+}
+
 static void scroll_callback(GLFWwindow *window, double xoffset, double yoffset) {
+	mark_input();
+
 	if (xoffset == 0.0 && yoffset == 0.0)
 		return;
 
+	// Distance fields can be drawn at any size, so zooming only has to change the size of the cells
+	bool ctrl_held = glfwGetKey(window, GLFW_KEY_LEFT_CONTROL) == GLFW_PRESS || glfwGetKey(window, GLFW_KEY_RIGHT_CONTROL) == GLFW_PRESS;
+	if (ctrl_held) {
+		if (font_render.format == GLYPH_FORMAT_SDF && yoffset != 0.0) {
+			font_size += yoffset > 0.0 ? 1.0f : -1.0f;
+			font_size = font_size < MIN_FONT_SIZE ? MIN_FONT_SIZE : font_size > MAX_FONT_SIZE ? MAX_FONT_SIZE : font_size;
+
+			zoom_font_render(font_render, font_size);
+			input_state.column = input_state.x / font_render.cell_w;
+			input_state.row = input_state.y / font_render.cell_h;
+			needs_resubmit = true;
+		}
+		return;
+	}
+
 	int64_t move_down = 0;
 	int64_t move_right = 0;
 
@@ -292,6 +790,8 @@ static void scroll_callback(GLFWwindow *window, double xoffset, double yoffset)
 }
 
 static void mouse_button_callback(GLFWwindow* window, int button, int action, int mods) {
+	mark_input();
+
 	bool left_pressed  = action == GLFW_PRESS && button == GLFW_MOUSE_BUTTON_LEFT;
 	bool right_pressed = action == GLFW_PRESS && button == GLFW_MOUSE_BUTTON_RIGHT;
 
@@ -301,6 +801,9 @@ static void mouse_button_callback(GLFWwindow* window, int button, int action, in
 	if (!left_pressed)
 		input_state.thumb_flags &= ~1;
 
+	if (left_pressed)
+		file.journal.seal();
+
 	if ((input_state.left_flags & 3) == 1 && input_state.x >= vk.wnd_width - THUMB_WIDTH) {
 		int thumb_y, thumb_h;
 		get_thumb_position(&grid, file.total_size, thumb_y, thumb_h);
@@ -332,11 +835,19 @@ static void mouse_button_callback(GLFWwindow* window, int button, int action, in
 	needs_resubmit = true;
 }
 
+// The window system lost what was shown, for example because the window was covered up
+static void refresh_callback(GLFWwindow *window) {
+	cell_shadow.invalidate();
+	needs_resubmit = true;
+}
+
 static void cursor_callback(GLFWwindow *window, double xpos, double ypos) {
+	mark_input();
+
 	input_state.x = (int)xpos;
 	input_state.y = (int)ypos;
-	input_state.column = input_state.x / font_render.glyph_w;
-	input_state.row = input_state.y / font_render.glyph_h;
+	input_state.column = input_state.x / font_render.cell_w;
+	input_state.row = input_state.y / font_render.cell_h;
 
 	if (input_state.thumb_flags & 1) {
 		int64_t offset = get_file_offset_from_thumb(&grid, file.total_size);
@@ -355,9 +866,35 @@ static void cursor_callback(GLFWwindow *window, double xpos, double ypos) {
 }
 
 int main(int argc, char **argv) {
-	const char *file_name = "vulkan.cpp";
-	if (argc > 1)
-		file_name = argv[1];
+	bool use_sdf = false;
+	int glyph_bits = 8;
+
+	for (int i = 1; i < argc; i++) {
+		// "-" on its own means stdin
+		if (!strcmp(argv[i], "-f") || !strcmp(argv[i], "--follow"))
+			follow_file = true;
+		else if (!strcmp(argv[i], "--sdf"))
+			use_sdf = true;
+		else if (!strcmp(argv[i], "--4bpp"))
+			glyph_bits = 4;
+		else if (!strcmp(argv[i], "--glyph-buffer"))
+			use_glyph_image = false;
+		else if (!strcmp(argv[i], "--bench") && i+1 < argc)
+			bench_frames = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "--stats"))
+			show_stats = true;
+		else if (!strcmp(argv[i], "--present") && i+1 < argc) {
+			const char *mode = argv[++i];
+			if (!strcmp(mode, "mailbox"))
+				vk.present_mode = VK_PRESENT_MODE_MAILBOX_KHR;
+			else if (!strcmp(mode, "immediate"))
+				vk.present_mode = VK_PRESENT_MODE_IMMEDIATE_KHR;
+			else
+				vk.present_mode = VK_PRESENT_MODE_FIFO_KHR;
+		}
+		else
+			file_name = argv[i];
+	}
 
 	atexit([](){ft_quit();});
 
@@ -366,7 +903,16 @@ int main(int argc, char **argv) {
 		return 1;
 
 	// TODO: Use system DPI
-	font_render = size_up_font_render(font_face, 10, 96, 96);
+	if (use_sdf) {
+		font_render = size_up_font_render(font_face, SDF_REFERENCE_SIZE, 96, 96);
+		font_render.format = GLYPH_FORMAT_SDF;
+		zoom_font_render(font_render, font_size);
+	}
+	else {
+		font_render = size_up_font_render(font_face, font_size, 96, 96);
+	}
+
+	set_glyph_bits(font_render, glyph_bits);
 
 	formatter.modes[0].fore_color_idx = 1;
 	formatter.modes[0].glyphset = 0; // italic
@@ -396,10 +942,21 @@ int main(int argc, char **argv) {
 		.pCode = (uint32_t*)fragment_spv_data
 	};
 
-	if (file.open(file_name) < 0)
+	glfwInit();
+
+	// Wakes up the main loop when more input arrives from a pipe
+	file.on_stream_data = []() { glfwPostEmptyEvent(); };
+	file.save.on_progress = []() { glfwPostEmptyEvent(); };
+
+	if (file.open(file_name) < 0) {
+		fprintf(stderr, "Could not open \"%s\"\n", file_name);
+		glfwTerminate();
 		return 2;
+	}
+
+	file.lines.build_async(&file, LINE_INDEX_BUDGET);
+	file.journal.max_bytes = UNDO_BUDGET;
 
-	glfwInit();
 	glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
 	glfwWindowHint(GLFW_RESIZABLE, GLFW_FALSE);
 
@@ -418,18 +975,26 @@ int main(int argc, char **argv) {
 	}
 
 	glfwSetKeyCallback(window, key_callback);
+	glfwSetCharCallback(window, char_callback);
 	glfwSetScrollCallback(window, scroll_callback);
 	glfwSetMouseButtonCallback(window, mouse_button_callback);
 	glfwSetCursorPosCallback(window, cursor_callback);
+	glfwSetWindowRefreshCallback(window, refresh_callback);
 
 	vk.glfw_monitor = (void*)monitor;
 	vk.glfw_window = (void*)window;
 
+	// The glyphsets get rasterized in the background while Vulkan starts up
+	glyph_bake.start(DEFAULT_FONT_PATH, font_render);
+
 	int res = init_vulkan(vk, vertex_buf, fragment_buf, width, height);
 	if (res == 0)
 		res = start_app(window);
 
 	file.close();
+	glyph_bake.destroy();
+	glyph_cache.destroy();
+	cell_shadow.destroy();
 
 	vk.close();
 	glfwDestroyWindow(window);
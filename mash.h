@@ -7,10 +7,39 @@
 constexpr int MiB = 1024 * 1024;
 constexpr uint64_t MAX_64 = -1;
 
-constexpr int GRIDS_POOL_SIZE         = 8 * MiB;
+// The grids pool starts with the colour palette, which is only uploaded once.
+// After it comes one region per frame in flight, so the CPU can fill one while the GPU still reads another.
+// Regions start at MIN_GRID_REGION_SIZE and double until the grid fits.
+constexpr int FRAMES_IN_FLIGHT        = 2;
+constexpr int GRID_PALETTE_SIZE       = Formatter::N_COLORS * sizeof(uint32_t);
+constexpr int MIN_GRID_REGION_SIZE    = 2 * MiB;
 constexpr int GLYPHSET_POOL_SIZE      = 8 * MiB;
 constexpr int VIEW_PARAMS_INITIAL_CAP = 8;
 
+// How many swapchain images to ask for. The driver may give more, up to MAX_SWAP_IMAGES.
+constexpr int SWAPCHAIN_IMAGES        = 3;
+constexpr int MAX_SWAP_IMAGES         = 8;
+
+// Device memory is taken from the driver in blocks at least this big, which pools and images are then carved out of
+constexpr int64_t GPU_BLOCK_SIZE      = 64 * MiB;
+constexpr int GPU_MAX_BLOCKS          = 16;
+
+// Glyphs outside ASCII: how many can be cached, and how many can be rasterized per frame before the rest wait for the next one
+constexpr int GLYPH_CACHE_SLOTS       = 4096;
+constexpr int GLYPHS_PER_FRAME        = 64;
+
+// Text size in points. With --sdf, glyphs are rasterized once at SDF_REFERENCE_SIZE and Ctrl+scroll zooms between the limits.
+constexpr float DEFAULT_FONT_SIZE   = 10.0f;
+constexpr float SDF_REFERENCE_SIZE  = 24.0f;
+constexpr float MIN_FONT_SIZE       = 6.0f;
+constexpr float MAX_FONT_SIZE       = 32.0f;
+
+constexpr int64_t LINE_INDEX_BUDGET = 64 * MiB;
+constexpr int64_t UNDO_BUDGET       = 16 * MiB;
+
+// How often to check whether some other process changed the file, unless it's being followed
+constexpr double WATCH_INTERVAL_SECS = 1.0;
+
 struct uvec2 {
 	uint32_t x, y;
 };
@@ -18,6 +47,10 @@ struct ivec2 {
 	int32_t x, y;
 };
 
+// Where the fragment shader reads glyphs from
+#define GLYPH_SOURCE_BUFFER 0
+#define GLYPH_SOURCE_IMAGE  1
+
 struct View_Params {
 	uvec2 view_origin;
 	uvec2 view_size;
@@ -31,32 +64,94 @@ struct View_Params {
 	uint32_t glyphset_byte_offset;
 	uint32_t glyph_overlap_w;
 	uint32_t glyph_full_w;
+	uint32_t glyph_h;
+	uint32_t glyph_format;
+	uint32_t glyph_bits;
+	uint32_t glyph_slot_size;
+	uint32_t glyph_source;
+	float glyph_scale;
+	uint32_t grid_rows;
+	uint32_t grid_row_base;
+};
+
+struct Gpu_Range {
+	int64_t offset;
+	int64_t size;
+};
+
+// Part of a Gpu_Block. ptr is only set if the block is host visible.
+struct Gpu_Alloc {
+	VkDeviceMemory mem;
+	uint8_t *ptr;
+	int64_t offset;
+	int64_t size;
+	int block;
+};
+
+// One vkAllocateMemory() worth of memory. The free list is kept sorted by offset, with neighbouring ranges always merged,
+// so freed space gets reused without ever having to move anything that's still allocated.
+struct Gpu_Block {
+	VkDeviceMemory mem;
+	uint8_t *mapped;
+	int64_t size;
+	int64_t used;
+	int mem_type;
+	int n_allocs;
+
+	Gpu_Range *free_list;
+	int n_free;
+	int free_cap;
+
+	void init(int64_t block_size);
+	void insert_free(int idx, Gpu_Range r);
+	int64_t take(int64_t len, int64_t align);
+	void give_back(int64_t offset, int64_t len);
+	void destroy();
+};
+
+struct Gpu_Stats {
+	int n_blocks;
+	int n_allocs;
+	int n_free_ranges;
+	int64_t reserved;
+	int64_t used;
+	int64_t largest_free;
 };
 
 struct Memory_Pool {
-	VkDeviceMemory dev_mem;
-	VkDeviceMemory host_mem;
+	Gpu_Alloc dev_alloc;
+	Gpu_Alloc host_alloc;
 	VkBuffer dev_buf;
 	VkBuffer host_buf;
 	uint8_t *staging_area;
 	int size;
 	VkResult result;
+	bool direct; // host_buf and dev_buf are the same device-local buffer, so staging_area is what the shader reads
+};
 
-	void close(VkDevice device) {
-		vkUnmapMemory(device, host_mem);
-
-		vkDestroyBuffer(device, dev_buf, nullptr);
-		vkDestroyBuffer(device, host_buf, nullptr);
-
-		vkFreeMemory(device, dev_mem, nullptr);
-		vkFreeMemory(device, host_mem, nullptr);
-	}
+// Everything one frame needs while it's in flight. grid_offset is where its cells live, in both the staging and device buffers of grids_pool.
+struct Frame_Slot {
+	VkCommandBuffer cmd;
+	VkFence fence;
+	VkSemaphore sema_present;
+	int grid_offset;
+	int grid_size;
+
+	// Only the rows that changed since this slot's region was last written get copied, and a range can wrap around the end of the ring.
+	// damage is which rows of the frame this slot holds weren't there in the frame before it, after scrolling by scroll rows.
+	// The region is a ring of rows that starts at ring_base.
+	VkBufferCopy grid_copies[MAX_DAMAGE_RANGES * 2];
+	int n_grid_copies;
+	Damage damage;
+	int scroll;
+	int ring_base;
 };
 
 enum {
 	ID_GetPhysicalDeviceSurfaceSupport = 0,
 	ID_GetPhysicalDeviceSurfaceCapabilities,
 	ID_GetPhysicalDeviceSurfaceFormats,
+	ID_GetPhysicalDeviceSurfacePresentModes,
 	ID_CreateDebugUtilsMessenger,
 	ID_DestroyDebugUtilsMessenger,
 	ID_CreateSwapchain,
@@ -72,6 +167,11 @@ struct Vulkan {
 	int n_view_params = 0;
 	int view_param_cap = 0;
 
+	// Which parts of the window changed in the frame about to be presented, if the driver has VK_KHR_incremental_present. None means all of it.
+	VkRectLayerKHR damage_rects[MAX_DAMAGE_RANGES];
+	int n_damage_rects = 0;
+	bool has_incremental_present = false;
+
 	const VkImageUsageFlags img_usage =
 		VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT |
 		VK_IMAGE_USAGE_TRANSFER_SRC_BIT |
@@ -86,6 +186,7 @@ struct Vulkan {
 	VkInstance instance = {0};
 	VkPhysicalDevice gpu = {0};
 	VkPhysicalDeviceMemoryProperties gpu_mem = {0};
+	VkPhysicalDeviceProperties gpu_props = {0};
 	VkQueue queue = {0};
 	VkDevice device = {0};
 
@@ -98,26 +199,44 @@ struct Vulkan {
 	VkSwapchainKHR swapchain = {0};
 	VkRenderPass renderpass = {0};
 
-	VkImage swap_image;
-	VkImageView swap_image_view;
-	VkFramebuffer framebuffer;
-	VkCommandBuffer draw_buffer;
-	VkFence draw_fence;
+	// present_mode is what was asked for, which falls back to FIFO if the surface doesn't support it
+	VkPresentModeKHR present_mode = VK_PRESENT_MODE_FIFO_KHR;
+
+	// Presenting an image waits on the semaphore of that image rather than of the frame slot, since the order images come back in isn't fixed
+	VkImage swap_images[MAX_SWAP_IMAGES] = {0};
+	VkImageView swap_image_views[MAX_SWAP_IMAGES] = {0};
+	VkFramebuffer framebuffers[MAX_SWAP_IMAGES] = {0};
+	VkSemaphore swap_sema_render[MAX_SWAP_IMAGES] = {0};
+	int n_swap_images = 0;
+
+	Frame_Slot frames[FRAMES_IN_FLIGHT] = {0};
+	int cur_frame = 0;
 
 	VkCommandPool cmd_pool = {0};
 	VkFence misc_fence = {0};
 
-	VkSemaphore sema_present = {0};
-	VkSemaphore sema_render = {0};
-
 	int queue_index = 0;
 
 	VkDescriptorPool dpool = {0};
 	VkDescriptorSetLayout ds_layout = {0};
 	VkDescriptorSet desc_set = {0};
 
+	Gpu_Block mem_blocks[GPU_MAX_BLOCKS] = {0};
+	int n_mem_blocks = 0;
+
 	Memory_Pool glyphset_pool = {0};
 	Memory_Pool grids_pool = {0};
+	int grid_region_size = 0;
+
+	VkImage glyph_image = {0};
+	Gpu_Alloc glyph_image_mem = {0};
+	VkImageView glyph_image_view = {0};
+	VkSampler glyph_sampler = {0};
+	VkExtent3D glyph_extent = {0};
+	int glyph_layers = 0;
+	bool glyph_image_ready = false; // whether it's been moved out of VK_IMAGE_LAYOUT_UNDEFINED yet
+
+	VkQueryPool timestamp_pool = {0};
 
 	VkDeviceMemory dst_mem = {0};
 	VkBuffer mvp_buf = {0};
@@ -145,6 +264,9 @@ struct Vulkan {
 	VkResult GetPhysicalDeviceSurfaceFormatsKHR(VkPhysicalDevice physicalDevice, VkSurfaceKHR surface, uint32_t* pSurfaceFormatCount, VkSurfaceFormatKHR* pSurfaceFormats) {
 		return ((PFN_vkGetPhysicalDeviceSurfaceFormatsKHR)khr_table[ID_GetPhysicalDeviceSurfaceFormats])(physicalDevice, surface, pSurfaceFormatCount, pSurfaceFormats);
 	}
+	VkResult GetPhysicalDeviceSurfacePresentModesKHR(VkPhysicalDevice physicalDevice, VkSurfaceKHR surface, uint32_t* pPresentModeCount, VkPresentModeKHR* pPresentModes) {
+		return ((PFN_vkGetPhysicalDeviceSurfacePresentModesKHR)khr_table[ID_GetPhysicalDeviceSurfacePresentModes])(physicalDevice, surface, pPresentModeCount, pPresentModes);
+	}
 
 	VkResult CreateDebugUtilsMessenger(VkInstance instance, const VkDebugUtilsMessengerCreateInfoEXT *pCreateInfo, const VkAllocationCallbacks* pAllocator, VkDebugUtilsMessengerEXT* pCallback) {
 		return ((PFN_vkCreateDebugUtilsMessengerEXT)khr_table[ID_CreateDebugUtilsMessenger])(instance, pCreateInfo, pAllocator, pCallback);
@@ -177,25 +299,46 @@ struct Vulkan {
 	int load_khr_extensions();
 	VkResult setup_validation();
 	int select_bgra8_surface_format();
+	void select_present_mode();
 	VkResult create_swapchain();
+	int create_swap_images();
+	void destroy_swap_images();
 	int create_command_pool_and_draw_buffers();
 	VkResult create_renderpass();
-	VkResult create_framebuffer();
 	VkResult create_semaphores();
 	void create_fences();
 
-	Memory_Pool allocate_gpu_memory(int size);
+	Gpu_Alloc alloc_memory(VkMemoryRequirements& reqs, uint32_t mem_flags);
+	void free_memory(Gpu_Alloc& a);
+	Gpu_Stats get_memory_stats();
+
+	Memory_Pool allocate_gpu_memory(int size, bool allow_direct);
+	Memory_Pool allocate_direct_memory(int size);
+	void free_pool(Memory_Pool& pool);
 	int push_to_gpu(Memory_Pool& pool, int offset, int size);
+	int push_ranges_to_gpu(Memory_Pool& pool, VkBufferCopy *ranges, int n_ranges);
+	VkCommandBuffer begin_transfer();
+	int end_transfer(VkCommandBuffer copy_cmd);
+	int resize_grids_pool(int region_size);
+	void write_grids_descriptor();
+	uint8_t *begin_frame(int grid_size);
+
+	int create_glyph_image(int width, int height, int layers);
+	int push_glyphs_to_image(Memory_Pool& pool, const int *slots, int n_slots, int slot_size);
+
+	void create_timestamp_queries();
+	double last_frame_gpu_ms();
 
 	int create_descriptor_set();
 	int construct_pipeline();
-	int update_command_buffers();
+	int update_command_buffers(int image_idx);
 
 	int recreate_swapchain(int width, int height);
 
 	int render();
 };
 
+const char *present_mode_name(VkPresentModeKHR mode);
 const char **get_required_instance_extensions(uint32_t *n_inst_exts);
 VkResult create_window_surface(VkInstance& instance, void *window, VkSurfaceKHR *surface);
 
@@ -0,0 +1,514 @@
+#include <stdint.h>
+#include <string.h>
+#include "view.h"
+
+void Piece_Table::begin(File *file) {
+	if (active)
+		return;
+
+	// Node 0 stands in for an empty subtree
+	nodes.resize(1);
+	memset(&nodes.data[0], 0, sizeof(Piece));
+
+	root = 0;
+	free_node = 0;
+	seed = 0x9e3779b9;
+	added.init();
+
+	if (file->source_size > 0)
+		root = new_node(PIECE_SOURCE, 0, file->source_size, 0, -1);
+
+	active = true;
+}
+
+void Piece_Table::destroy() {
+	if (!active)
+		return;
+
+	added.destroy();
+	nodes.resize(0);
+	root = 0;
+	free_node = 0;
+	active = false;
+}
+
+int Piece_Table::new_node(int type, int64_t start, int64_t len, int64_t first_line, int64_t lines) {
+	int t = free_node;
+	if (t)
+		free_node = nodes.data[t].left;
+	else {
+		t = nodes.size;
+		nodes.resize(t + 1);
+	}
+
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+
+	Piece& p = nodes.data[t];
+	p.type = type;
+	p.left = 0;
+	p.right = 0;
+	p.priority = seed;
+	p.start = start;
+	p.len = len;
+	p.first_line = first_line;
+	p.lines = lines;
+
+	update(t);
+	return t;
+}
+
+void Piece_Table::free_tree(int t) {
+	if (!t)
+		return;
+
+	free_tree(nodes.data[t].left);
+	free_tree(nodes.data[t].right);
+
+	nodes.data[t].left = free_node;
+	free_node = t;
+}
+
+void Piece_Table::update(int t) {
+	Piece& p = nodes.data[t];
+	Piece& l = nodes.data[p.left];
+	Piece& r = nodes.data[p.right];
+
+	p.sub_len = l.sub_len + p.len + r.sub_len;
+	p.sub_lines = l.sub_lines + (p.lines > 0 ? p.lines : 0) + r.sub_lines;
+}
+
+int Piece_Table::rightmost(int t) {
+	while (t && nodes.data[t].right)
+		t = nodes.data[t].right;
+	return t;
+}
+
+// Adds to the length and line count of the last piece under t. A negative line count means the new part hasn't been counted.
+void Piece_Table::grow_last(int t, int64_t len, int64_t lines) {
+	Piece& p = nodes.data[t];
+	if (p.right) {
+		grow_last(p.right, len, lines);
+	}
+	else {
+		p.len += len;
+		if (lines < 0)
+			p.lines = -1;
+		else if (p.lines >= 0)
+			p.lines += lines;
+	}
+	update(t);
+}
+
+// Makes sure that the last piece under t has its lines counted, since something is about to go after it
+void Piece_Table::count_last(File *file, int t) {
+	Piece& p = nodes.data[t];
+	if (p.right) {
+		count_last(file, p.right);
+	}
+	else if (p.lines < 0) {
+		int64_t end_line = file->source_line_of(p.start + p.len);
+		nodes.data[t].lines = end_line - nodes.data[t].first_line;
+	}
+	update(t);
+}
+
+int64_t Piece_Table::count_added_lines(int64_t start, int64_t len) {
+	int64_t count = 0;
+	while (len > 0) {
+		int64_t avail;
+		const char *p = added.get(start, &avail);
+		if (avail > len)
+			avail = len;
+
+		count += count_newlines(p, avail);
+		start += avail;
+		len -= avail;
+	}
+	return count;
+}
+
+// Cuts piece t after its first k bytes, returning a new node for the rest of it.
+// The new node gets the same priority, so that it can take t's place in the treap.
+int Piece_Table::cut_piece(File *file, int t, int64_t k) {
+	Piece p = nodes.data[t];
+
+	int64_t head_lines, tail_first_line = 0;
+	if (p.type == PIECE_SOURCE) {
+		tail_first_line = file->source_line_of(p.start + k);
+		head_lines = tail_first_line - p.first_line;
+	}
+	else {
+		head_lines = count_added_lines(p.start, k);
+	}
+
+	int64_t tail_lines = p.lines < 0 ? -1 : p.lines - head_lines;
+
+	int u = new_node(p.type, p.start + k, p.len - k, tail_first_line, tail_lines);
+	nodes.data[u].priority = p.priority;
+
+	nodes.data[t].len = k;
+	nodes.data[t].lines = head_lines;
+	return u;
+}
+
+// Splits the text under t so that *l holds the first 'pos' bytes and *r the rest
+void Piece_Table::split(File *file, int t, int64_t pos, int *l, int *r) {
+	if (!t) {
+		*l = *r = 0;
+		return;
+	}
+
+	int64_t left_len = nodes.data[nodes.data[t].left].sub_len;
+	int64_t len = nodes.data[t].len;
+
+	if (pos <= left_len) {
+		int a, b;
+		split(file, nodes.data[t].left, pos, &a, &b);
+		nodes.data[t].left = b;
+		update(t);
+		*l = a;
+		*r = t;
+	}
+	else if (pos >= left_len + len) {
+		int a, b;
+		split(file, nodes.data[t].right, pos - left_len - len, &a, &b);
+		nodes.data[t].right = a;
+		update(t);
+		*l = t;
+		*r = b;
+	}
+	else {
+		int u = cut_piece(file, t, pos - left_len);
+		nodes.data[u].right = nodes.data[t].right;
+		nodes.data[t].right = 0;
+		update(t);
+		update(u);
+		*l = t;
+		*r = u;
+	}
+}
+
+int Piece_Table::merge(int a, int b) {
+	if (!a) return b;
+	if (!b) return a;
+
+	if (nodes.data[a].priority > nodes.data[b].priority) {
+		int right = merge(nodes.data[a].right, b);
+		nodes.data[a].right = right;
+		update(a);
+		return a;
+	}
+
+	int left = merge(a, nodes.data[b].left);
+	nodes.data[b].left = left;
+	update(b);
+	return b;
+}
+
+// Returns the piece that holds 'offset', along with where it starts in the text and how many newlines come before it
+int Piece_Table::find(int64_t offset, int64_t *node_start, int64_t *lines_before) {
+	int64_t base = 0;
+	int64_t lines = 0;
+	int t = root;
+
+	while (t) {
+		Piece& p = nodes.data[t];
+		Piece& l = nodes.data[p.left];
+
+		if (offset < base + l.sub_len) {
+			t = p.left;
+			continue;
+		}
+
+		base += l.sub_len;
+		lines += l.sub_lines;
+
+		if (offset < base + p.len) {
+			*node_start = base;
+			*lines_before = lines;
+			return t;
+		}
+
+		base += p.len;
+		lines += p.lines;
+		t = p.right;
+	}
+
+	return 0;
+}
+
+// Appends the pieces under t to refs, in order
+void Piece_Table::collect(int t, Vector<Piece_Ref>& refs) {
+	if (!t)
+		return;
+
+	collect(nodes.data[t].left, refs);
+
+	Piece& p = nodes.data[t];
+	int n = refs.size;
+	refs.resize(n + 1);
+	refs.data[n] = {
+		.type = p.type,
+		.start = p.start,
+		.len = p.len,
+		.first_line = p.first_line,
+		.lines = p.lines
+	};
+
+	collect(nodes.data[t].right, refs);
+}
+
+void Piece_Table::append_source(File *file, int64_t old_size, int64_t new_size) {
+	int last = rightmost(root);
+	Piece& p = nodes.data[last];
+
+	if (last && p.type == PIECE_SOURCE && p.start + p.len == old_size) {
+		grow_last(root, new_size - old_size, -1);
+	}
+	else {
+		if (root)
+			count_last(file, root);
+
+		int u = new_node(PIECE_SOURCE, old_size, new_size - old_size, file->source_line_of(old_size), -1);
+		root = merge(root, u);
+	}
+
+	file->total_size += new_size - old_size;
+}
+
+const char *Piece_Table::get_block(File *file, int64_t offset, int64_t *start, int64_t *len) {
+	if (offset < 0 || offset >= file->total_size)
+		return nullptr;
+
+	int64_t node_start, lines_before;
+	int t = find(offset, &node_start, &lines_before);
+	if (!t)
+		return nullptr;
+
+	Piece& p = nodes.data[t];
+	int64_t inner = p.start + (offset - node_start);
+
+	// Find the block that holds the byte in whichever buffer the piece comes from, then clip it to the piece
+	const char *base;
+	int64_t b_start, b_len;
+
+	if (p.type == PIECE_ADDED) {
+		int64_t avail;
+		int64_t in_chunk = inner % FILE_CHUNK_SIZE;
+		base = added.get(inner, &avail) - in_chunk;
+		b_start = inner - in_chunk;
+		b_len = FILE_CHUNK_SIZE;
+	}
+	else {
+		base = file->get_source_block(inner, &b_start, &b_len);
+		if (!base)
+			return nullptr;
+	}
+
+	int64_t lo = b_start > p.start ? b_start : p.start;
+	int64_t hi = b_start + b_len < p.start + p.len ? b_start + b_len : p.start + p.len;
+
+	*start = node_start + (lo - p.start);
+	*len = hi - lo;
+	return &base[lo - b_start];
+}
+
+// These give a point at or before the requested line/offset, along with the line it's on. It may not be the start of that line.
+
+void Piece_Table::nearest_line(File *file, int64_t line, int64_t& found_line, int64_t& found_offset) {
+	found_line = 0;
+	found_offset = 0;
+	if (line <= 0)
+		return;
+
+	// Look for the last piece that starts before the line does
+	int64_t base = 0;
+	int64_t lines = 0;
+	int best = 0;
+	int t = root;
+
+	while (t) {
+		Piece& p = nodes.data[t];
+		Piece& l = nodes.data[p.left];
+
+		int64_t p_line = lines + l.sub_lines;
+		if (p_line >= line) {
+			t = p.left;
+			continue;
+		}
+
+		best = t;
+		found_line = p_line;
+		found_offset = base + l.sub_len;
+
+		if (p.lines < 0 || p_line + p.lines >= line)
+			break;
+
+		base += l.sub_len + p.len;
+		lines = p_line + p.lines;
+		t = p.right;
+	}
+
+	if (!best)
+		return;
+
+	// The source index can usually get a lot closer than the start of the piece
+	Piece& p = nodes.data[best];
+	if (p.type == PIECE_SOURCE) {
+		int64_t idx_line, idx_offset;
+		file->lines.nearest_line(p.first_line + (line - found_line), idx_line, idx_offset);
+
+		if (idx_offset > p.start && idx_offset < p.start + p.len) {
+			found_line += idx_line - p.first_line;
+			found_offset += idx_offset - p.start;
+		}
+	}
+}
+
+void Piece_Table::nearest_offset(File *file, int64_t offset, int64_t& found_line, int64_t& found_offset) {
+	found_line = 0;
+	found_offset = 0;
+
+	if (offset >= file->total_size)
+		offset = file->total_size - 1;
+	if (offset <= 0)
+		return;
+
+	int64_t node_start;
+	int t = find(offset, &node_start, &found_line);
+	if (!t)
+		return;
+
+	found_offset = node_start;
+
+	Piece& p = nodes.data[t];
+	if (p.type == PIECE_SOURCE) {
+		int64_t idx_line, idx_offset;
+		file->lines.nearest_offset(p.start + (offset - node_start), idx_line, idx_offset);
+
+		if (idx_offset > p.start) {
+			found_line += idx_line - p.first_line;
+			found_offset += idx_offset - p.start;
+		}
+	}
+}
+
+int File::insert(int64_t offset, const char *text, int64_t len) {
+	if (len <= 0 || offset < 0 || offset > total_size)
+		return -1;
+
+	pieces.begin(this);
+	Chunk_List& added = pieces.added;
+
+	int64_t added_start = added.size;
+	int64_t done = 0;
+
+	while (done < len) {
+		int64_t avail;
+		char *buf = added.reserve(&avail);
+		if (!buf)
+			return -2;
+
+		if (avail > len - done)
+			avail = len - done;
+
+		memcpy(buf, &text[done], avail);
+		added.commit(avail);
+		done += avail;
+	}
+
+	int64_t n_lines = pieces.count_added_lines(added_start, len);
+
+	int l, r;
+	pieces.split(this, pieces.root, offset, &l, &r);
+
+	// Typing carries on from the end of the last insert, in which case that piece just gets longer
+	int last = pieces.rightmost(l);
+	Piece& p = pieces.nodes.data[last];
+
+	if (last && p.type == PIECE_ADDED && p.start + p.len == added_start) {
+		pieces.grow_last(l, len, n_lines);
+	}
+	else {
+		if (l)
+			pieces.count_last(this, l);
+
+		int u = pieces.new_node(PIECE_ADDED, added_start, len, 0, n_lines);
+		l = pieces.merge(l, u);
+	}
+
+	pieces.root = pieces.merge(l, r);
+
+	total_size += len;
+	span_len = 0;
+
+	if (!journal.replaying) {
+		Piece_Ref ref = {
+			.type = PIECE_ADDED,
+			.start = added_start,
+			.len = len,
+			.first_line = 0,
+			.lines = n_lines
+		};
+		journal.record(UNDO_INSERT, offset, len, &ref, 1);
+	}
+
+	return 0;
+}
+
+// Puts pieces that were taken out before back in at 'offset', for undo and redo
+int File::insert_pieces(int64_t offset, const Piece_Ref *refs, int n_refs) {
+	if (offset < 0 || offset > total_size)
+		return -1;
+
+	pieces.begin(this);
+
+	int l, r;
+	pieces.split(this, pieces.root, offset, &l, &r);
+
+	if (l)
+		pieces.count_last(this, l);
+
+	for (int i = 0; i < n_refs; i++) {
+		const Piece_Ref& ref = refs[i];
+
+		// Only the last piece of the text gets away without its lines counted
+		int64_t lines = ref.lines;
+		if (lines < 0 && (r || i < n_refs - 1))
+			lines = source_line_of(ref.start + ref.len) - ref.first_line;
+
+		int u = pieces.new_node((int)ref.type, ref.start, ref.len, ref.first_line, lines);
+		l = pieces.merge(l, u);
+		total_size += ref.len;
+	}
+
+	pieces.root = pieces.merge(l, r);
+	span_len = 0;
+	return 0;
+}
+
+int File::remove(int64_t offset, int64_t len) {
+	if (offset < 0 || len <= 0 || offset + len > total_size)
+		return -1;
+
+	pieces.begin(this);
+
+	int l, m, r;
+	pieces.split(this, pieces.root, offset, &l, &m);
+	pieces.split(this, m, len, &m, &r);
+
+	if (!journal.replaying) {
+		Vector<Piece_Ref> refs;
+		pieces.collect(m, refs);
+		journal.record(UNDO_REMOVE, offset, len, refs.data, refs.size);
+	}
+
+	pieces.free_tree(m);
+	pieces.root = pieces.merge(l, r);
+
+	total_size -= len;
+	span_len = 0;
+	return 0;
+}
@@ -0,0 +1,137 @@
+#include <stdint.h>
+#include <string.h>
+#include "view.h"
+
+int File::save_as(const char *path) {
+	if (save.running)
+		return -1;
+
+	finish_save();
+
+	int len = strlen(path);
+	save.path = new char[len + 1];
+	strcpy(save.path, path);
+
+	// The temporary file has to be on the same filesystem as the target for the rename to be atomic
+	save.temp_path = new char[len + 12];
+	strcpy(save.temp_path, path);
+	strcpy(&save.temp_path[len], ".mash-save");
+
+	save.refs.resize(0);
+	if (pieces.active) {
+		pieces.collect(pieces.root, save.refs);
+	}
+	else if (source_size > 0) {
+		save.refs.resize(1);
+		save.refs.data[0] = {
+			.type = PIECE_SOURCE,
+			.start = 0,
+			.len = source_size,
+			.first_line = 0,
+			.lines = -1
+		};
+	}
+
+	save.kernel_copy = 2;
+	save.total = total_size;
+	save.written = 0;
+	save.result = 0;
+	save.running = true;
+	save.worker = std::thread([this]() { save_worker(); });
+	return 0;
+}
+
+// Reads part of the unedited source into buf, for when the OS can't copy it to the output by itself
+int64_t File::read_source(int64_t offset, char *buf, int64_t len) {
+	if (!stream && !comp)
+		return read_at(offset, buf, len);
+
+	// Streams and compressed files can only be read a whole chunk at a time from outside the UI thread
+	int64_t base = offset - offset % FILE_CHUNK_SIZE;
+	if (offset + len > base + FILE_CHUNK_SIZE)
+		len = base + FILE_CHUNK_SIZE - offset;
+
+	int64_t range = offset + len - base;
+	const char *p = acquire_range(base, range);
+	if (!p)
+		return -1;
+
+	memcpy(buf, &p[offset - base], len);
+	release_range(p, range);
+	return len;
+}
+
+void File::save_worker() {
+	Save_Job& s = save;
+	char *buf = nullptr;
+	int last_percent = 0;
+
+	int res = create_output(s.temp_path);
+
+	for (int i = 0; i < s.refs.size && res >= 0; i++) {
+		Piece_Ref& r = s.refs.data[i];
+
+		int64_t done = 0;
+		while (done < r.len) {
+			int64_t want = r.len - done;
+			if (want > SAVE_STEP)
+				want = SAVE_STEP;
+
+			int64_t n = 0;
+			if (r.type == PIECE_ADDED) {
+				// The add buffer only ever grows, so this is safe to read while the UI thread keeps typing
+				int64_t avail;
+				const char *p = pieces.added.get(r.start + done, &avail);
+				n = write_output(p, want < avail ? want : avail);
+			}
+			else {
+				n = copy_to_output(r.start + done, want);
+				if (n == 0) {
+					if (!buf)
+						buf = new char[SAVE_BUFFER_SIZE];
+
+					n = read_source(r.start + done, buf, want < SAVE_BUFFER_SIZE ? want : SAVE_BUFFER_SIZE);
+					if (n > 0)
+						n = write_output(buf, n);
+				}
+			}
+
+			if (n <= 0) {
+				res = -2;
+				break;
+			}
+
+			done += n;
+			s.written += n;
+
+			int percent = s.total > 0 ? (int)(s.written * 100 / s.total) : 100;
+			if (percent != last_percent && s.on_progress)
+				s.on_progress();
+			last_percent = percent;
+		}
+	}
+
+	delete[] buf;
+
+	// A failed save leaves the target alone
+	int closed = close_output(res >= 0);
+	if (closed < 0 && res >= 0)
+		res = closed - 2;
+
+	s.result = res >= 0 ? 1 : res;
+	s.running = false;
+
+	if (s.on_progress)
+		s.on_progress();
+}
+
+// Waits for the last save to finish
+void File::finish_save() {
+	if (save.worker.joinable())
+		save.worker.join();
+
+	delete[] save.path;
+	delete[] save.temp_path;
+	save.path = nullptr;
+	save.temp_path = nullptr;
+}
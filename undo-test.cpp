@@ -0,0 +1,72 @@
+#include <stdio.h>
+#include <string.h>
+#include "view.h"
+
+static bool text_is(File& file, const char *expected) {
+	int64_t len = strlen(expected);
+	if (file.total_size != len)
+		return false;
+
+	for (int64_t i = 0; i < len; i++) {
+		if (file.at(i) != expected[i])
+			return false;
+	}
+	return true;
+}
+
+static int fail(const char *what) {
+	printf("FAIL: %s\n", what);
+	return 1;
+}
+
+int main(int argc, char **argv) {
+	if (argc != 2) {
+		printf("Undo Journal Test\n"
+			"Usage: %s <scratch file path>\n", argv[0]);
+		return 1;
+	}
+
+	FILE *f = fopen(argv[1], "wb");
+	if (!f)
+		return 2;
+	fputs("hello world", f);
+	fclose(f);
+
+	File file = {0};
+	if (file.open(argv[1]) != 0)
+		return 2;
+
+	// A one-entry group, then a replace whose two entries are bigger than the whole budget on their own
+	file.journal.max_bytes = sizeof(Undo_Entry) + sizeof(Piece_Ref) + sizeof(int64_t) + 1;
+
+	file.journal.begin_group();
+	file.insert(11, "!", 1);
+	file.journal.end_group();
+
+	file.journal.begin_group();
+	file.remove(0, 5);
+	file.insert(0, "HELLO", 5);
+	file.journal.end_group();
+
+	if (!text_is(file, "HELLO world!"))
+		return fail("the edits didn't apply");
+
+	int64_t first, cursor;
+	if (!file.undo(&first, &cursor))
+		return fail("the replace couldn't be undone");
+	if (!text_is(file, "hello world!"))
+		return fail("undoing the replace left it half reverted");
+
+	// The older group is what made room
+	if (file.undo(&first, &cursor))
+		return fail("the older group should have been dropped");
+
+	if (!file.redo(&first, &cursor) || !text_is(file, "HELLO world!"))
+		return fail("redoing the replace didn't bring it back");
+
+	file.close();
+	remove(argv[1]);
+
+	printf("ok\n");
+	return 0;
+}
@@ -0,0 +1,233 @@
+#include <stdint.h>
+#include <string.h>
+#include "view.h"
+
+#define UNDO_INITIAL_CAP  (64 << 10)
+
+void Undo_Journal::begin_group() {
+	if (depth++ == 0) {
+		group++;
+		sealed = true;
+	}
+}
+
+void Undo_Journal::end_group() {
+	if (depth > 0)
+		depth--;
+}
+
+// Makes sure there's room for 'bytes' more after tail, moving the live entries down to the start of the arena if it helps
+void Undo_Journal::make_room(int64_t bytes) {
+	if (tail + bytes <= arena_cap)
+		return;
+
+	int64_t used = tail - head;
+	if (head > 0 && used + bytes <= arena_cap) {
+		memmove(arena, &arena[head], used);
+	}
+	else {
+		int64_t cap = arena_cap > 0 ? arena_cap : UNDO_INITIAL_CAP;
+		while (cap < used + bytes)
+			cap *= 2;
+
+		char *new_arena = new char[cap];
+		if (used > 0)
+			memcpy(new_arena, &arena[head], used);
+
+		delete[] arena;
+		arena = new_arena;
+		arena_cap = cap;
+	}
+
+	cur -= head;
+	tail -= head;
+	head = 0;
+}
+
+// Changes how many refs the last entry has, moving its footer to match
+void Undo_Journal::resize_last(int n_refs) {
+	Undo_Entry *e = entry_before(tail);
+	int64_t pos = tail - e->size;
+	int64_t size = sizeof(Undo_Entry) + n_refs * sizeof(Piece_Ref) + sizeof(int64_t);
+
+	if (size > e->size) {
+		make_room(size - e->size);
+		pos = tail - entry_before(tail)->size;
+	}
+
+	e = entry_at(pos);
+	e->n_refs = n_refs;
+	e->size = size;
+
+	tail = pos + size;
+	cur = tail;
+	*(int64_t*)&arena[tail - sizeof(int64_t)] = size;
+}
+
+static bool join_refs(Piece_Ref& a, const Piece_Ref& b) {
+	if (a.type != b.type || a.start + a.len != b.start)
+		return false;
+
+	a.len += b.len;
+	a.lines = a.lines < 0 || b.lines < 0 ? -1 : a.lines + b.lines;
+	return true;
+}
+
+void Undo_Journal::record(int type, int64_t offset, int64_t len, const Piece_Ref *refs, int n_refs) {
+	// A new edit means that whatever was undone can't be redone anymore
+	tail = cur;
+
+	Undo_Entry *e = cur > head ? entry_before(cur) : nullptr;
+	bool can_join = e && !sealed && e->type == type && (depth == 0 || e->group == group);
+
+	// Typing at the end of the last insert, or pressing Delete in the same place, adds to the end of the last entry
+	if (can_join && offset == e->offset + (type == UNDO_INSERT ? e->len : 0)) {
+		e->len += len;
+
+		int n = e->n_refs;
+		int skip = n > 0 && n_refs > 0 && join_refs(refs_of(e)[n-1], refs[0]) ? 1 : 0;
+
+		resize_last(n + n_refs - skip);
+		e = entry_before(tail);
+		memcpy(&refs_of(e)[n], &refs[skip], (n_refs - skip) * sizeof(Piece_Ref));
+
+		evict();
+		return;
+	}
+
+	// Backspacing adds to the start of it instead
+	if (can_join && type == UNDO_REMOVE && offset + len == e->offset) {
+		e->offset = offset;
+		e->len += len;
+
+		int n = e->n_refs;
+		Piece_Ref last = refs[n_refs-1];
+		int skip = n > 0 && join_refs(last, refs_of(e)[0]) ? 1 : 0;
+
+		resize_last(n_refs + n - skip);
+		e = entry_before(tail);
+
+		Piece_Ref *dst = refs_of(e);
+		memmove(&dst[n_refs], &dst[skip], (n - skip) * sizeof(Piece_Ref));
+		memcpy(dst, refs, (n_refs - 1) * sizeof(Piece_Ref));
+		dst[n_refs-1] = last;
+
+		evict();
+		return;
+	}
+
+	int64_t size = sizeof(Undo_Entry) + n_refs * sizeof(Piece_Ref) + sizeof(int64_t);
+	make_room(size);
+
+	e = entry_at(tail);
+	e->type = type;
+	e->n_refs = n_refs;
+	e->group = depth > 0 ? group : ++group;
+	e->offset = offset;
+	e->len = len;
+	e->size = size;
+
+	memcpy(refs_of(e), refs, n_refs * sizeof(Piece_Ref));
+
+	tail += size;
+	cur = tail;
+	*(int64_t*)&arena[tail - sizeof(int64_t)] = size;
+
+	sealed = false;
+	evict();
+}
+
+// Drops the oldest groups until the journal fits in max_bytes again, always keeping the latest group whole.
+// Undoing only part of a group, like the insert of a replace without its remove, would leave the text half reverted.
+void Undo_Journal::evict() {
+	if (max_bytes <= 0)
+		return;
+
+	int64_t last = tail;
+	int64_t newest = entry_before(tail)->group;
+	while (last > head && entry_before(last)->group == newest)
+		last -= entry_before(last)->size;
+
+	while (tail - head > max_bytes && head < last) {
+		int64_t g = entry_at(head)->group;
+		while (head < last && entry_at(head)->group == g)
+			head += entry_at(head)->size;
+	}
+}
+
+void Undo_Journal::destroy() {
+	delete[] arena;
+	arena = nullptr;
+	arena_cap = 0;
+	head = cur = tail = 0;
+	depth = 0;
+}
+
+// Both of these return 1 if there was anything to undo/redo. *first is set to the lowest offset that changed,
+// and *cursor to where the cursor should go.
+
+int File::undo(int64_t *first, int64_t *cursor) {
+	Undo_Journal& j = journal;
+	if (j.cur <= j.head)
+		return 0;
+
+	j.replaying = true;
+
+	int64_t g = j.entry_before(j.cur)->group;
+	*first = total_size;
+
+	while (j.cur > j.head && j.entry_before(j.cur)->group == g) {
+		Undo_Entry *e = j.entry_before(j.cur);
+
+		if (e->type == UNDO_INSERT) {
+			remove(e->offset, e->len);
+			*cursor = e->offset;
+		}
+		else {
+			insert_pieces(e->offset, j.refs_of(e), e->n_refs);
+			*cursor = e->offset + e->len;
+		}
+
+		if (e->offset < *first)
+			*first = e->offset;
+
+		j.cur -= e->size;
+	}
+
+	j.replaying = false;
+	j.seal();
+	return 1;
+}
+
+int File::redo(int64_t *first, int64_t *cursor) {
+	Undo_Journal& j = journal;
+	if (j.cur >= j.tail)
+		return 0;
+
+	j.replaying = true;
+
+	int64_t g = j.entry_at(j.cur)->group;
+	*first = total_size;
+
+	while (j.cur < j.tail && j.entry_at(j.cur)->group == g) {
+		Undo_Entry *e = j.entry_at(j.cur);
+
+		if (e->type == UNDO_INSERT) {
+			insert_pieces(e->offset, j.refs_of(e), e->n_refs);
+			*cursor = e->offset + e->len;
+		}
+		else {
+			remove(e->offset, e->len);
+			*cursor = e->offset;
+		}
+
+		if (e->offset < *first)
+			*first = e->offset;
+
+		j.cur += e->size;
+	}
+
+	j.replaying = false;
+	j.seal();
+	return 1;
+}
@@ -0,0 +1,246 @@
+#include <stdint.h>
+#include <string.h>
+#include "view.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define UTF8_X86 1
+#include <immintrin.h>
+#endif
+
+// A character is either a valid UTF-8 sequence or a single byte that isn't part of one, and takes up one column either way.
+// Invalid bytes come out as UTF8_INVALID, so a broken sequence never swallows the bytes after it.
+
+static inline bool is_continuation(char c) {
+	return ((uint8_t)c & 0xc0) == 0x80;
+}
+
+// How long a sequence starting with b is supposed to be, where bytes that can't start one count as 1
+static inline int expected_length(uint8_t b) {
+	if (b < 0xc2) return 1;
+	if (b < 0xe0) return 2;
+	if (b < 0xf0) return 3;
+	if (b < 0xf5) return 4;
+	return 1;
+}
+
+// Decodes the character at p, where 'avail' bytes can be read. Returns how many bytes it takes up.
+int utf8_decode(const char *p, int64_t avail, uint32_t *cp) {
+	static const uint32_t min_value[5] = {0, 0, 0x80, 0x800, 0x10000};
+
+	uint8_t b = (uint8_t)p[0];
+	if (b < 0x80) {
+		*cp = b;
+		return 1;
+	}
+
+	*cp = UTF8_INVALID;
+
+	int len = expected_length(b);
+	if (len == 1 || len > avail)
+		return 1;
+
+	uint32_t c = b & (0x7f >> len);
+	for (int i = 1; i < len; i++) {
+		if (!is_continuation(p[i]))
+			return 1;
+
+		c = (c << 6) | ((uint8_t)p[i] & 0x3f);
+	}
+
+	// Overlong encodings, surrogates and anything past U+10FFFF
+	if (c < min_value[len] || c > 0x10ffff || (c >= 0xd800 && c <= 0xdfff))
+		return 1;
+
+	*cp = c;
+	return len;
+}
+
+// Counts the columns taken by the characters in p[i..stop), where p can be read up to len.
+// Stops before a character that would run past len, leaving i on it.
+static int64_t count_columns_scalar(const char *p, int64_t& i, int64_t stop, int64_t len, int64_t col, int64_t spt) {
+	while (i < stop) {
+		uint8_t b = (uint8_t)p[i];
+
+		if (b == '\t') {
+			col += spt - (col % spt);
+			i++;
+		}
+		else if (b < 0x80) {
+			col++;
+			i++;
+		}
+		else {
+			if (i + expected_length(b) > len)
+				break;
+
+			uint32_t cp;
+			i += utf8_decode(&p[i], len - i, &cp);
+			col++;
+		}
+	}
+
+	return col;
+}
+
+#ifdef UTF8_X86
+
+// Blocks of plain ASCII without tabs are one column per byte. Anything else in a block goes through the scalar path,
+// which validates it and picks up again wherever the last character in the block ends.
+
+static int64_t count_columns_sse2(const char *p, int64_t len, int64_t col, int64_t spt, int64_t *done) {
+	const __m128i tab = _mm_set1_epi8('\t');
+	int64_t i = 0;
+
+	while (i + 16 <= len) {
+		__m128i v = _mm_loadu_si128((const __m128i*)&p[i]);
+
+		if ((_mm_movemask_epi8(v) | _mm_movemask_epi8(_mm_cmpeq_epi8(v, tab))) == 0) {
+			col += 16;
+			i += 16;
+			continue;
+		}
+
+		int64_t stop = i + 16;
+		col = count_columns_scalar(p, i, stop, len, col, spt);
+		if (i < stop)
+			break;
+	}
+
+	col = count_columns_scalar(p, i, len, len, col, spt);
+	*done = i;
+	return col;
+}
+
+__attribute__((target("avx2")))
+static int64_t count_columns_avx2(const char *p, int64_t len, int64_t col, int64_t spt, int64_t *done) {
+	const __m256i tab = _mm256_set1_epi8('\t');
+	int64_t i = 0;
+
+	while (i + 32 <= len) {
+		__m256i v = _mm256_loadu_si256((const __m256i*)&p[i]);
+
+		if ((_mm256_movemask_epi8(v) | _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, tab))) == 0) {
+			col += 32;
+			i += 32;
+			continue;
+		}
+
+		int64_t stop = i + 32;
+		col = count_columns_scalar(p, i, stop, len, col, spt);
+		if (i < stop)
+			break;
+	}
+
+	col = count_columns_scalar(p, i, len, len, col, spt);
+	*done = i;
+	return col;
+}
+
+#else
+
+static int64_t count_columns_plain(const char *p, int64_t len, int64_t col, int64_t spt, int64_t *done) {
+	int64_t i = 0;
+	col = count_columns_scalar(p, i, len, len, col, spt);
+	*done = i;
+	return col;
+}
+
+#endif
+
+typedef int64_t (*Count_Columns_Func)(const char*, int64_t, int64_t, int64_t, int64_t*);
+
+static Count_Columns_Func pick_count_columns_func() {
+#ifdef UTF8_X86
+	if (__builtin_cpu_supports("avx2"))
+		return count_columns_avx2;
+
+	return count_columns_sse2;
+#else
+	return count_columns_plain;
+#endif
+}
+
+// Returns the column that p[0..len) ends on when it starts on 'col', where p starts on a character and doesn't contain a newline.
+// *done is set to how many bytes were counted, which is less than len if the last character is cut off.
+int64_t count_columns(const char *p, int64_t len, int64_t col, int spaces_per_tab, int64_t *done) {
+	static Count_Columns_Func func = pick_count_columns_func();
+	return func(p, len, col, (int64_t)spaces_per_tab, done);
+}
+
+// Returns the character that starts at 'offset' and sets *next to where the next one starts
+uint32_t File::decode_char(int64_t offset, int64_t *next) {
+	char buf[4];
+	buf[0] = at(offset);
+
+	uint32_t cp = (uint8_t)buf[0];
+	int len = 1;
+
+	if (cp >= 0x80) {
+		int64_t avail = total_size - offset;
+		if (avail > 4)
+			avail = 4;
+
+		for (int i = 1; i < avail; i++)
+			buf[i] = at(offset + i);
+
+		len = utf8_decode(buf, avail, &cp);
+	}
+
+	*next = offset + len;
+	return cp;
+}
+
+int64_t File::next_char(int64_t offset) {
+	if (offset >= total_size)
+		return total_size;
+
+	int64_t next;
+	decode_char(offset, &next);
+	return next;
+}
+
+// A character ends right before 'offset' if the nearest lead byte before it starts a valid sequence that ends there.
+// Otherwise the byte before is a character on its own.
+int64_t File::prev_char(int64_t offset) {
+	if (offset <= 0)
+		return 0;
+
+	int64_t start = offset - 1;
+	while (start > 0 && start > offset - 4 && is_continuation(at(start)))
+		start--;
+
+	if (start < offset - 1) {
+		int64_t next;
+		if (decode_char(start, &next) != UTF8_INVALID && next == offset)
+			return start;
+	}
+
+	return offset - 1;
+}
+
+// Counts the columns between two offsets on the same line, a span at a time
+int64_t File::count_columns_between(int64_t from, int64_t to, int spaces_per_tab) {
+	int64_t col = 0;
+
+	while (from < to) {
+		int64_t avail;
+		const char *p = get_span(from, &avail);
+		if (!p)
+			break;
+
+		if (avail > to - from)
+			avail = to - from;
+
+		int64_t done;
+		col = count_columns(p, avail, col, spaces_per_tab, &done);
+		from += done;
+
+		// A character that's split between two spans
+		if (done < avail) {
+			decode_char(from, &from);
+			col++;
+		}
+	}
+
+	return col;
+}
@@ -13,7 +13,17 @@ void Formatter::update_highlighter(File *file, int64_t offset, char c) {
 	
 }
 
-void Grid::render_into(File *file, Cell *cells, Formatter *formatter, Input_State& input, int wnd_width, int wnd_height)
+// Printable ASCII always has a glyph in every glyphset. Anything else comes from the glyph cache, apart from control characters
+static inline uint32_t glyph_slot(Glyph_Cache *glyphs, uint32_t cp, uint32_t glyph_off) {
+	if (cp >= ' ' && cp <= '~')
+		return cp - ' ' + glyph_off;
+	if (cp < 0xa0 || !glyphs)
+		return GLYPH_FALLBACK + glyph_off;
+
+	return glyphs->lookup(cp, (int)(glyph_off / GLYPHSET_SIZE));
+}
+
+void Grid::render_into(File *file, Cell *cells, Formatter *formatter, Glyph_Cache *glyphs, Input_State& input, int wnd_width, int wnd_height)
 {
 	int line_num_gap = 0;
 	int total_line_num_gap = 0;
@@ -46,20 +56,20 @@ void Grid::render_into(File *file, Cell *cells, Formatter *formatter, Input_Stat
 	char *ln_buf = (char*)alloca(ln_digit_width + 1);
 	ln_buf[ln_digit_width] = 0;
 
-	uint32_t default_bg = formatter->colors[0];
-	uint32_t hl_color = formatter->colors[2];
+	// Indices into formatter->colors
+	uint32_t default_bg = 0;
+	uint32_t hl_color = 2;
 
 	bool hl =
 		((primary_cursor < grid_offset && secondary_cursor >= grid_offset) ||
 		(primary_cursor >= grid_offset && secondary_cursor < grid_offset));
 
 	Cell line_num_cell = {
-		.foreground = formatter->colors[3],
-		.background = formatter->colors[4]
+		.attrs = cell_attrs(3, 4, 0)
 	};
 
 	Cell empty = {
-		.background = hl ? hl_color : default_bg
+		.attrs = cell_attrs(0, hl ? hl_color : default_bg, 0)
 	};
 
 	this->rel_caret_col = -1;
@@ -82,12 +92,11 @@ void Grid::render_into(File *file, Cell *cells, Formatter *formatter, Input_Stat
 
 	formatter->cur_mode = mode_at_current_line;
 
-	char *data = file->data;
 	int64_t total_size = file->total_size;
 
 	int line = 0;
 	for ( ; line < rows && offset <= total_size; line++) {
-		if (total_size > 0 && offset == total_size && data[offset-1] != '\n')
+		if (total_size > 0 && offset == total_size && file->at(offset-1) != '\n')
 			break;
 
 		int64_t n = row_offset + (int64_t)line + 1; // +1 since line numbers are 1-indexed
@@ -104,12 +113,12 @@ void Grid::render_into(File *file, Cell *cells, Formatter *formatter, Input_Stat
 		cells[idx] = line_num_cell;
 
 		for (int i = 0; i < line_num_gap-1; i++) {
-			line_num_cell.glyph = i < ln_digit_width ? (uint32_t)(ln_buf[i] - ' ') : 0;
+			line_num_cell.glyph = i < ln_digit_width ? (uint16_t)(ln_buf[i] - ' ') : 0;
 			cells[idx + i+1] = line_num_cell;
 		}
 
 		if (line_num_gap >= cols || offset >= total_size) {
-			empty.background = hl ? hl_color : default_bg;
+			empty.attrs = cell_attrs(0, hl ? hl_color : default_bg, 0);
 
 			for (int j = 0; j < text_cols; j++)
 				cells[idx + line_num_gap + j] = empty;
@@ -126,14 +135,14 @@ void Grid::render_into(File *file, Cell *cells, Formatter *formatter, Input_Stat
 		bool early_bail = false;
 		bool cursor_set = false;
 
-		while (vis_cols < col_offset) {
-			char c = data[offset];
+		while (vis_cols < col_offset && offset < total_size) {
+			char c = file->at(offset);
 			formatter->update_highlighter(file, offset, c);
 
 			if (primary_cursor != secondary_cursor && (offset == primary_cursor || offset == secondary_cursor))
 				hl = !hl;
 
-			offset++;
+			offset = (c & 0x80) ? file->next_char(offset) : offset + 1;
 
 			if (c == '\n') {
 				early_bail = true;
@@ -146,7 +155,7 @@ void Grid::render_into(File *file, Cell *cells, Formatter *formatter, Input_Stat
 		}
 
 		if (early_bail) {
-			empty.background = hl ? hl_color : default_bg;
+			empty.attrs = cell_attrs(0, hl ? hl_color : default_bg, 0);
 
 			for (int j = 0; j < text_cols; j++)
 				cells[idx + line_num_gap + j] = empty;
@@ -165,13 +174,13 @@ void Grid::render_into(File *file, Cell *cells, Formatter *formatter, Input_Stat
 			cursor_set = true;
 		}
 
-		empty.background = hl ? hl_color : default_bg;
+		empty.attrs = cell_attrs(0, hl ? hl_color : default_bg, 0);
 
 		for (column = 0; column < leading_cols; column++)
 			cells[line_num_gap + idx + column] = empty;
 
 		while (column < text_cols && offset < total_size) {
-			char c = data[offset];
+			char c = file->at(offset);
 			formatter->update_highlighter(file, offset, c);
 
 			int n_spaces = c == '\t' ? spaces_per_tab - (((int)col_offset + column) % spaces_per_tab) : 1;
@@ -201,10 +210,13 @@ void Grid::render_into(File *file, Cell *cells, Formatter *formatter, Input_Stat
 			if (c == '\n')
 				break;
 
-			offset++;
+			// Anything outside ASCII takes up one cell per character, however many bytes it's made of
+			uint32_t cp = (uint8_t)c;
+			int64_t next = offset + 1;
+			if (cp >= 0x80)
+				cp = file->decode_char(offset, &next);
 
-			if (c < ' ' || c > '~')
-				c = 0x7f;
+			offset = next;
 
 			uint32_t fg, bg, glyph_off, modifier;
 			formatter->get_current_attrs(fg, bg, glyph_off, modifier);
@@ -213,10 +225,8 @@ void Grid::render_into(File *file, Cell *cells, Formatter *formatter, Input_Stat
 				bg = hl_color;
 
 			cells[line_num_gap + idx + column] = {
-				.glyph = (uint32_t)(c - ' ') + glyph_off,
-				.modifier = modifier,
-				.foreground = fg,
-				.background = bg
+				.glyph = (uint16_t)glyph_slot(glyphs, cp, glyph_off),
+				.attrs = cell_attrs(fg, bg, modifier)
 			};
 
 			column++;
@@ -229,20 +239,21 @@ void Grid::render_into(File *file, Cell *cells, Formatter *formatter, Input_Stat
 			rel_caret_row = line;
 		}
 
-		empty.background = hl ? hl_color : default_bg;
+		empty.attrs = cell_attrs(0, hl ? hl_color : default_bg, 0);
 
 		for (int j = column; j < text_cols; j++)
 			cells[line_num_gap + idx + j] = empty;
 
 		idx += cols;
 
-		if (offset < total_size) {
-			char c = 0;
-			do {
-				c = data[offset];
-				formatter->update_highlighter(file, offset, c);
-				offset++;
-			} while (c != '\n');
+		// The last line might not end with a newline
+		while (offset < total_size) {
+			char c = file->at(offset);
+			formatter->update_highlighter(file, offset, c);
+			offset++;
+
+			if (c == '\n')
+				break;
 		}
 	}
 
@@ -258,98 +269,193 @@ void Grid::render_into(File *file, Cell *cells, Formatter *formatter, Input_Stat
 		cells[i] = empty;
 }
 
-void Grid::move_cursor_vertically(File *file, int dir, int target_col) {
-	char *data = file->data;
-	int64_t size = file->total_size;
-	int64_t spt_64 = (int64_t)spaces_per_tab;
-	int64_t offset = primary_cursor;
-
-	if (dir > 0) {
-		for (int i = 0; i < dir; i++) {
-			while (offset < size) {
-				char c = data[offset++];
-				if (c == '\n')
-					break;
-			}
+void Damage::add(int start, int end) {
+	start = start > 0 ? start : 0;
+	if (full || start >= end)
+		return;
 
-			if (offset >= size) {
-				primary_cursor = size;
-				return;
-			}
+	// Everything this touches gets merged into it
+	int i = 0;
+	while (i < n_ranges && ranges[i].end < start)
+		i++;
+
+	int j = i;
+	for ( ; j < n_ranges && ranges[j].start <= end; j++) {
+		start = ranges[j].start < start ? ranges[j].start : start;
+		end = ranges[j].end > end ? ranges[j].end : end;
+	}
+
+	if (j > i) {
+		ranges[i] = {start, end};
+		memmove(&ranges[i+1], &ranges[j], (n_ranges - j) * sizeof(Row_Range));
+		n_ranges -= j - i - 1;
+		return;
+	}
+
+	if (n_ranges == MAX_DAMAGE_RANGES) {
+		int best = 0;
+		for (int k = 1; k < n_ranges - 1; k++) {
+			if (ranges[k+1].start - ranges[k].end < ranges[best+1].start - ranges[best].end)
+				best = k;
 		}
+
+		ranges[best].end = ranges[best+1].end;
+		memmove(&ranges[best+1], &ranges[best+2], (n_ranges - best - 2) * sizeof(Row_Range));
+		n_ranges--;
+
+		add(start, end);
+		return;
 	}
-	else {
-		int n = -dir + 1;
-		for (int i = 0; i < n; i++) {
-			while (offset > 0) {
-				char c = data[--offset];
-				if (c == '\n')
-					break;
-			}
+
+	memmove(&ranges[i+1], &ranges[i], (n_ranges - i) * sizeof(Row_Range));
+	ranges[i] = {start, end};
+	n_ranges++;
+}
+
+void Damage::merge(const Damage& other) {
+	full = full || other.full;
+	for (int i = 0; i < other.n_ranges && !full; i++)
+		add(other.ranges[i].start, other.ranges[i].end);
+}
+
+// Moves the ranges up by n rows, dropping whatever ends up outside of [0, rows)
+void Damage::shift(int n, int rows) {
+	if (full || n == 0)
+		return;
+
+	int count = 0;
+	for (int i = 0; i < n_ranges; i++) {
+		int start = ranges[i].start - n;
+		int end = ranges[i].end - n;
+		if (start < 0)
+			start = 0;
+		if (end > rows)
+			end = rows;
+
+		if (end > start)
+			ranges[count++] = {start, end};
+	}
+
+	n_ranges = count;
+}
+
+Cell *Cell_Shadow::begin(int n_rows, int n_cols, int64_t top_row) {
+	int size = n_rows * n_cols;
+	if (size > cap) {
+		delete[] cur;
+		delete[] prev;
+		cur = new Cell[size];
+		prev = new Cell[size];
+		cap = size;
+		has_prev = false;
+	}
+
+	if (n_rows != rows || n_cols != cols)
+		has_prev = false;
+
+	rows = n_rows;
+	cols = n_cols;
+	first_row = top_row;
+	return cur;
+}
+
+// Each row is compared against the one it scrolled from, so scrolling by k rows only damages the k rows that came into view.
+// Returns how many rows the grid scrolled down by, which is negative if it went up.
+int Cell_Shadow::diff(Damage& damage) {
+	int64_t scroll = first_row - prev_first_row;
+	if (!has_prev || scroll <= -rows || scroll >= rows) {
+		damage.full = true;
+		return 0;
+	}
+
+	int run = -1;
+	for (int r = 0; r < rows; r++) {
+		int from = r + (int)scroll;
+		bool same = from >= 0 && from < rows && memcmp(&cur[r * cols], &prev[from * cols], cols * sizeof(Cell)) == 0;
+		if (!same && run < 0) {
+			run = r;
 		}
+		else if (same && run >= 0) {
+			damage.add(run, r);
+			run = -1;
+		}
+	}
 
-		if (offset > 0)
-			offset++;
+	if (run >= 0)
+		damage.add(run, rows);
+
+	return (int)scroll;
+}
+
+void Cell_Shadow::swap() {
+	Cell *c = cur;
+	cur = prev;
+	prev = c;
+	prev_first_row = first_row;
+	has_prev = true;
+}
+
+void Cell_Shadow::destroy() {
+	delete[] cur;
+	delete[] prev;
+	cur = prev = nullptr;
+	rows = cols = cap = 0;
+	has_prev = false;
+}
+
+void Grid::move_cursor_vertically(File *file, int dir, int target_col) {
+	int64_t size = file->total_size;
+	int64_t spt_64 = (int64_t)spaces_per_tab;
+
+	int64_t line_start;
+	int64_t line = file->find_line_of(primary_cursor, row_offset, grid_offset, &line_start);
+
+	int64_t target = line + (int64_t)dir;
+	if (target < 0)
+		target = 0;
+
+	int64_t found_line;
+	int64_t offset = file->find_line(target, line, line_start, &found_line);
+
+	if (dir > 0 && found_line < target) {
+		primary_cursor = size;
+		return;
 	}
 
 	int64_t col = 0;
 	while (col < target_col && offset < size) {
-		char c = data[offset];
+		char c = file->at(offset);
 		if (c == '\n')
 			break;
 
 		col += c == '\t' ? spt_64 - (col % spt_64) : 1;
-		offset++;
+		offset = (c & 0x80) ? file->next_char(offset) : offset + 1;
 	}
 
 	primary_cursor = offset;
 }
 
 void Grid::adjust_offsets(File *file, int64_t move_down, int64_t move_right) {
-	char *data = file->data;
 	int64_t size = file->total_size;
-	if (!data || size <= 0)
+	if (size <= 0)
 		return;
 
+	int64_t view_len = end_grid_offset - grid_offset;
+
 	col_offset += move_right;
 	if (col_offset < 0) col_offset = 0;
 
-	int64_t old_row_off = row_offset;
-	row_offset += move_down;
+	int64_t target = row_offset + move_down;
 
-	if (row_offset <= 0) {
+	if (target <= 0) {
 		row_offset = 0;
 		grid_offset = 0;
-		return;
 	}
-
-	int64_t r = old_row_off;
-	int64_t off = grid_offset;
-
-	if (row_offset > old_row_off) {
-		while (r < row_offset && off < size) {
-			if (data[off++] == '\n') {
-				grid_offset = off;
-				r++;
-			}
-		}
-
-		row_offset = r;
+	else if (target != row_offset) {
+		grid_offset = file->find_line(target, row_offset, grid_offset, &row_offset);
 	}
-	else if (row_offset < old_row_off) {
-		int64_t r = old_row_off;
-		int64_t off = grid_offset;
-
-		while (r >= row_offset && off > 0) {
-			if (data[--off] == '\n') {
-				grid_offset = off;
-				r--;
-			}
-		}
 
-		grid_offset = off + 1;
-		row_offset = r + 1;
-	}
+	file->note_viewport(grid_offset, grid_offset + view_len);
 }
 
 int64_t Grid::jump_to_offset(File *file, int64_t offset, int flags) {
@@ -361,78 +467,27 @@ int64_t Grid::jump_to_offset(File *file, int64_t offset, int flags) {
 	if (offset > file->total_size)
 		offset = file->total_size;
 
-	int64_t row = 0;
-	int64_t col = 0;
-
 	int64_t rows_64 = (int64_t)rows;
 	int64_t cols_64 = (int64_t)cols;
-	int64_t spt_64 = (int64_t)spaces_per_tab;
-
-	char *data = file->data;
-	int64_t size = file->total_size;
 
-	if (offset < grid_offset) {
-		int64_t off = grid_offset;
-		int64_t lines_up = 0;
+	int64_t view_len = end_grid_offset - grid_offset;
 
-		while (off > offset) {
-			char c = data[--off];
-			if (c == '\n') {
-				lines_up++;
-			}
-		}
+	int64_t line_start;
+	int64_t line = file->find_line_of(offset, row_offset, grid_offset, &line_start);
 
-		row_offset -= lines_up;
-		off = offset;
+	int64_t col = file->count_columns_between(line_start, offset, spaces_per_tab);
 
-		while (off > 0) {
-			char c = data[--off];
-			if (c == '\n') {
-				off++;
-				break;
-			}
-
-			// this is likely wrong
-			if (c == '\t')
-				col += spt_64 - (col % spt_64);
-			else
-				col++;
-		}
-
-		grid_offset = off;
+	if (offset < grid_offset || (flags & JUMP_FLAG_TOP)) {
+		grid_offset = line_start;
+		row_offset = line;
 	}
-	else {
-		int64_t off = grid_offset;
-		int64_t line_offset = grid_offset;
-		int64_t lines_down = 0;
-
-		int64_t *offset_list = (int64_t*)alloca(rows * sizeof(int64_t));
-		offset_list[0] = grid_offset;
-
-		while (off < offset) {
-			char c = data[off++];
-			if (c == '\n') {
-				lines_down++;
-				offset_list[lines_down % rows_64] = off;
-				line_offset = off;
-				col = 0;
-			}
-			else if (c == '\t')
-				col += spt_64 - (col % spt_64);
-			else
-				col++;
-		}
-
-		if (flags & JUMP_FLAG_TOP) {
-			grid_offset = line_offset;
-			row_offset += lines_down;
-		}
-		else if (lines_down >= rows_64) {
-			grid_offset = offset_list[(lines_down + 1) % rows_64];
-			row_offset += lines_down - rows_64 + 1;
-		}
+	else if (line - row_offset >= rows_64) {
+		int64_t top = line - rows_64 + 1;
+		grid_offset = file->find_line(top, line, line_start, &row_offset);
 	}
 
+	file->note_viewport(grid_offset, grid_offset + view_len);
+
 	if (flags & JUMP_FLAG_AFFECT_COLUMN) {
 		col_offset = 0;
 
@@ -444,3 +499,73 @@ int64_t Grid::jump_to_offset(File *file, int64_t offset, int flags) {
 	//primary_cursor = offset;
 	return offset;
 }
+
+// Moves the cursor to 'cursor' after the text from 'first' onwards has changed
+void Grid::after_edit(File *file, int64_t first, int64_t cursor) {
+	// An edit above the top of the grid moves everything below it, so the top has to be found again
+	if (first < grid_offset)
+		row_offset = file->find_line_of(first, 0, 0, &grid_offset);
+
+	primary_cursor = jump_to_offset(file, cursor, JUMP_FLAG_AFFECT_COLUMN);
+	secondary_cursor = primary_cursor;
+}
+
+// Keeps the view on the same line number after the file changed underneath it, or on the last line if there aren't that many anymore
+void Grid::restore_view(File *file) {
+	grid_offset = file->find_line(row_offset, 0, 0, &row_offset);
+
+	if (primary_cursor > file->total_size)
+		primary_cursor = file->total_size;
+	if (secondary_cursor > file->total_size)
+		secondary_cursor = file->total_size;
+}
+
+// Replaces [start, end) with text, leaving the cursor just after it
+void Grid::replace_range(File *file, int64_t start, int64_t end, const char *text, int64_t len) {
+	// Typing over a selection gets undone in one step
+	bool both = end > start && len > 0;
+	if (both)
+		file->journal.begin_group();
+
+	if (end > start)
+		file->remove(start, end - start);
+	if (len > 0)
+		file->insert(start, text, len);
+
+	if (both)
+		file->journal.end_group();
+
+	after_edit(file, start, start + len);
+}
+
+void Grid::insert_text(File *file, const char *text, int64_t len) {
+	int64_t start = primary_cursor < secondary_cursor ? primary_cursor : secondary_cursor;
+	int64_t end = primary_cursor < secondary_cursor ? secondary_cursor : primary_cursor;
+
+	replace_range(file, start, end, text, len);
+}
+
+// Deletes the selection if there is one, otherwise the character before (dir < 0) or after (dir > 0) the cursor
+void Grid::erase(File *file, int dir) {
+	int64_t start = primary_cursor < secondary_cursor ? primary_cursor : secondary_cursor;
+	int64_t end = primary_cursor < secondary_cursor ? secondary_cursor : primary_cursor;
+
+	if (start == end) {
+		if (dir < 0 && start > 0)
+			start = file->prev_char(start);
+		else if (dir > 0 && end < file->total_size)
+			end = file->next_char(end);
+		else
+			return;
+	}
+
+	replace_range(file, start, end, nullptr, 0);
+}
+
+void Grid::undo(File *file, bool redo) {
+	int64_t first, cursor;
+	int res = redo ? file->redo(&first, &cursor) : file->undo(&first, &cursor);
+
+	if (res > 0)
+		after_edit(file, first, cursor);
+}
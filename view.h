@@ -1,11 +1,64 @@
 #pragma once
 
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+#include "font.h"
+
 #define THUMB_WIDTH 14
 #define THUMB_FRAC 0.15625
 
 #define JUMP_FLAG_TOP            1
 #define JUMP_FLAG_AFFECT_COLUMN  2
 
+// Files bigger than FILE_WHOLE_MAP_LIMIT are mapped through a few FILE_WINDOW_SIZE windows instead of all at once
+#define FILE_WHOLE_MAP_LIMIT  (1LL << 30)
+#define FILE_WINDOW_SIZE      (64LL << 20)
+#define FILE_MAX_WINDOWS      4
+
+// Input that can't be mapped (pipes, stdin) is read into chunks of this size instead
+#define FILE_CHUNK_SIZE       (4LL << 20)
+#define FILE_MAX_CHUNKS       (1 << 16)
+
+// The last FILE_TAIL_SAMPLE bytes of a file are kept, to tell whether it was appended to or rewritten when it grows
+#define FILE_TAIL_SAMPLE      64
+
+#define REFRESH_GREW     1
+#define REFRESH_CHANGED  2
+
+#define PREFETCH_MIN_AHEAD     (1LL << 20)
+#define PREFETCH_MAX_AHEAD     (64LL << 20)
+#define PREFETCH_EVICT_BEHIND  (256LL << 20)
+#define PREFETCH_LOOKAHEAD_SECS  0.5
+
+#define ADVISE_WILLNEED  0
+#define ADVISE_COLD      1
+
+#define PIECE_SOURCE  0
+#define PIECE_ADDED   1
+
+#define UNDO_INSERT  0
+#define UNDO_REMOVE  1
+
+// Saving reports progress at least every SAVE_STEP bytes. Text that can't be copied file-to-file goes through a SAVE_BUFFER_SIZE buffer.
+#define SAVE_STEP         (64LL << 20)
+#define SAVE_BUFFER_SIZE  (1LL << 20)
+
+// Shown in place of bytes that aren't valid UTF-8
+#define UTF8_INVALID  0xfffd
+
+#define COMP_GZIP  1
+#define COMP_ZSTD  2
+
+// Compressed files are decompressed a FILE_CHUNK_SIZE block at a time, keeping the last COMP_CACHE_BLOCKS of them.
+// Seek points are made every COMP_POINT_SPAN bytes of output, then thinned out whenever they outgrow COMP_INDEX_BUDGET.
+#define COMP_CACHE_BLOCKS  16
+#define COMP_POINT_SPAN    (8LL << 20)
+#define COMP_INDEX_BUDGET  (32LL << 20)
+#define COMP_WINDOW_SIZE   32768
+#define COMP_INPUT_SIZE    (256 << 10)
+
 template <typename T>
 struct Vector {
 	static constexpr int INLINE_SIZE = 16;
@@ -15,12 +68,7 @@ struct Vector {
 	T *data;
 	T stack[INLINE_SIZE];
 
-	Vector() {
-		cap = INLINE_SIZE;
-		size = INLINE_SIZE;
-		data = &stack[0];
-		stack = {0};
-	}
+	Vector() : cap(INLINE_SIZE), size(0), data(&stack[0]), stack() {}
 	~Vector() {
 		if (data && data != &stack[0])
 			delete[] data;
@@ -48,14 +96,372 @@ struct Vector {
 	}
 };
 
-struct File {
-	char os_handle[16];
+struct File;
+
+int64_t count_newlines(const char *p, int64_t len);
+
+int utf8_decode(const char *p, int64_t avail, uint32_t *cp);
+int64_t count_columns(const char *p, int64_t len, int64_t col, int spaces_per_tab, int64_t *done);
+
+// Start offsets of every nth line (n = stride), filled in by a background thread so that the view can keep rendering while it runs.
+// Once the table outgrows max_bytes, every second entry is dropped and the stride doubles.
+struct Line_Index {
+	std::mutex mtx;
+	Vector<int64_t> offsets;
+	int64_t stride;
+	int64_t max_bytes;
+	int64_t n_lines;
+	int64_t scanned;
+	int64_t target;
+	bool running;
+	bool complete;
+
+	std::atomic<bool> cancel;
+	std::thread worker;
+
+	void build_async(File *file, int64_t budget);
+	void extend(File *file, int64_t size);
+	void truncate(int64_t offset);
+	int64_t first_mismatch(File *file, int64_t limit);
+	void stop();
+	void scan(File *file);
+
+	// Both of these return the closest indexed line at or before the requested line/offset
+	void nearest_line(int64_t line, int64_t& found_line, int64_t& found_offset);
+	void nearest_offset(int64_t offset, int64_t& found_line, int64_t& found_offset);
+};
+
+// Tracks which way and how fast the viewport moves through a file, so that pages can be read in before the view gets to them
+struct Prefetcher {
+	int64_t view_start;
+	int64_t view_end;
+	int64_t ahead_start;
+	int64_t ahead_end;
+	int64_t evicted_below;
+	int64_t evicted_above;
+	int dir;
+	double speed; // bytes per second
+	double last_time;
+
+	int64_t bytes_prefetched;
+	int64_t bytes_evicted;
+	int64_t faults_avoided; // pages that became visible after being prefetched
+};
+
+// Append-only storage made of fixed-size chunks. Chunks never move once allocated, so other threads
+// can read anything below 'size' while the writer keeps appending.
+struct Chunk_List {
+	char **chunks;
+	int n_chunks;
+	std::atomic<int64_t> size;
+
+	void init();
+	void destroy();
+
+	// reserve() returns where the next bytes should go and how many fit there; commit() makes them visible
+	char *reserve(int64_t *avail);
+	void commit(int64_t len);
 
+	const char *get(int64_t offset, int64_t *avail);
+};
+
+struct Comp_Decoder;
+
+struct Comp_Point {
+	int64_t in_offset;
+	int64_t out_offset;
+	int bits;     // gzip: how many bits of the byte before in_offset belong to the next deflate block
+	char *window; // gzip: the COMP_WINDOW_SIZE bytes of output before out_offset, or null at the start of the file
+};
+
+struct Comp_Block {
 	char *data;
-	int64_t total_size;
+	int64_t start;
+	int64_t len;
+	int64_t last_used;
+};
+
+// Seekable gzip or zstd file. A background pass decompresses the whole file once to record seek points, growing 'size' as it goes,
+// then the blocks that actually get looked at are decompressed again from the nearest point.
+struct Compressed_File {
+	int format;
+
+	std::mutex mtx; // guards points
+	Vector<Comp_Point> points;
+	int64_t point_span;
+
+	std::atomic<int64_t> size;
+	std::atomic<bool> cancel;
+	std::atomic<bool> done;
+	std::thread indexer;
+
+	// Only used by the UI thread
+	Comp_Block blocks[COMP_CACHE_BLOCKS];
+	int n_blocks;
+	int64_t block_clock;
+	Comp_Decoder *view_dec;
+
+	// Only used between File::acquire_range() and File::release_range(), which hold seq_mtx
+	std::mutex seq_mtx;
+	Comp_Decoder *seq_dec;
+	char *seq_buf;
+	int64_t seq_start;
+	int64_t seq_len;
+
+	void build_index(File *file);
+	void add_point(Comp_Decoder *dec, const char *window);
+	int seek(Comp_Decoder *dec, File *file, int64_t offset, char *scratch, int64_t scratch_len);
+	const char *get(File *file, int64_t offset, int64_t *avail);
+	const char *read_sequential(File *file, int64_t offset, int64_t len);
+	void destroy();
+};
+
+// A piece as the undo journal keeps it, which is enough to put it back into the table
+struct Piece_Ref {
+	int64_t type;
+	int64_t start;
+	int64_t len;
+	int64_t first_line;
+	int64_t lines;
+};
+
+struct Piece {
+	int type;
+	int left; // children are indices into Piece_Table::nodes, where 0 means none
+	int right;
+	uint32_t priority;
+
+	int64_t start;      // offset into the source or the add buffer
+	int64_t len;
+	int64_t first_line; // source pieces: line of the source that the piece starts on
+	int64_t lines;      // newlines in the piece, or -1 if they haven't been counted (only ever the last piece)
+
+	int64_t sub_len;
+	int64_t sub_lines;
+};
+
+// Edits split the text into pieces taken from either the source or an append-only add buffer, so the source is never copied.
+// The pieces form a treap in text order, where each node also holds the length and line count of its subtree,
+// which keeps finding an offset or a line O(log pieces). Until the first edit, the text is just the source.
+struct Piece_Table {
+	bool active;
+	Vector<Piece> nodes;
+	int root;
+	int free_node;
+	uint32_t seed;
+	Chunk_List added;
+
+	void begin(File *file);
+	void destroy();
+
+	int new_node(int type, int64_t start, int64_t len, int64_t first_line, int64_t lines);
+	void free_tree(int t);
+	void update(int t);
+	int rightmost(int t);
+	void grow_last(int t, int64_t len, int64_t lines);
+	void count_last(File *file, int t);
+	int cut_piece(File *file, int t, int64_t k);
+	void split(File *file, int t, int64_t pos, int *l, int *r);
+	int merge(int a, int b);
+	int find(int64_t offset, int64_t *node_start, int64_t *lines_before);
+	void collect(int t, Vector<Piece_Ref>& refs);
+
+	int64_t count_added_lines(int64_t start, int64_t len);
+	void append_source(File *file, int64_t old_size, int64_t new_size);
+
+	const char *get_block(File *file, int64_t offset, int64_t *start, int64_t *len);
+	void nearest_line(File *file, int64_t line, int64_t& found_line, int64_t& found_offset);
+	void nearest_offset(File *file, int64_t offset, int64_t& found_line, int64_t& found_offset);
+};
+
+// Header of an entry in the undo journal. It's followed by n_refs Piece_Refs that make up the text which was inserted or removed,
+// then the size of the whole entry again, so that entries can be walked backwards.
+struct Undo_Entry {
+	int type;
+	int n_refs;
+	int64_t group;
+	int64_t offset;
+	int64_t len;
+	int64_t size;
+};
+
+// Edits recorded as piece operations in one arena. Entries in [head, cur) can be undone and entries in [cur, tail) redone.
+// Typing or deleting in the same place keeps extending the last entry until seal() is called, and everything between
+// begin_group() and end_group() gets undone in one go. Once the journal uses more than max_bytes, the oldest groups are dropped.
+struct Undo_Journal {
+	char *arena;
+	int64_t arena_cap;
+	int64_t head;
+	int64_t cur;
+	int64_t tail;
+	int64_t max_bytes;
+
+	int64_t group;
+	int depth;
+	bool sealed;
+	bool replaying;
+
+	void seal() { sealed = true; }
+	void begin_group();
+	void end_group();
+
+	Undo_Entry *entry_at(int64_t pos) { return (Undo_Entry*)&arena[pos]; }
+	Undo_Entry *entry_before(int64_t pos) { return entry_at(pos - *(int64_t*)&arena[pos - sizeof(int64_t)]); }
+	Piece_Ref *refs_of(Undo_Entry *e) { return (Piece_Ref*)&e[1]; }
+
+	void make_room(int64_t bytes);
+	void resize_last(int n_refs);
+	void record(int type, int64_t offset, int64_t len, const Piece_Ref *refs, int n_refs);
+	void evict();
+	void destroy();
+};
+
+// A save in progress. The text is captured as piece refs when the save starts, so editing can carry on while a background thread
+// writes it to a temporary file next to the target, which then gets renamed over the target.
+struct Save_Job {
+	char out_handle[16];
+	char *path;
+	char *temp_path;
+	Vector<Piece_Ref> refs;
+	int kernel_copy; // Linux: 2 = copy_file_range, 1 = sendfile, 0 = neither works here
+
+	int64_t total;
+	std::atomic<int64_t> written;
+	std::atomic<int> result; // 0 while saving, 1 once saved, negative if it failed
+	std::atomic<bool> running;
+	std::thread worker;
+	void (*on_progress)();
+};
 
+struct File_Stat {
+	uint64_t dev;
+	uint64_t ino;
+	int64_t size;
+	int64_t mtime;
+};
+
+struct Mapped_Window {
+	char *ptr;
+	int64_t start;
+	int64_t len;
+	int64_t last_used;
+};
+
+struct File {
+	char os_handle[16];
+	char *path;
+
+	// What the file looked like the last time it was checked, to notice when another process changes or replaces it
+	File_Stat watched;
+	File_Stat watched_path;
+	char tail_sample[FILE_TAIL_SAMPLE];
+	int tail_len;
+
+	char *data; // only set if the whole file is mapped
+	int64_t source_size;
+	int64_t total_size; // size of the text after edits
+
+	Mapped_Window windows[FILE_MAX_WINDOWS];
+	int n_windows;
+	int64_t window_clock;
+
+	const char *span_ptr;
+	int64_t span_start;
+	int64_t span_len;
+
+	Chunk_List *stream;
+	std::thread stream_reader;
+	std::atomic<bool> stream_stop;
+	std::atomic<bool> stream_done;
+	std::atomic<bool> stream_notified;
+	void (*on_stream_data)(); // also called as a compressed file gets indexed
+
+	Compressed_File *comp;
+
+	Line_Index lines;
+	Prefetcher prefetch;
+	Piece_Table pieces;
+	Undo_Journal journal;
+	Save_Job save;
+
+	// refresh() returns REFRESH_GREW if text was only added at the end, or REFRESH_CHANGED if anything else may have changed
 	int open(const char *name);
+	int refresh();
 	void close();
+
+	int open_source(const char *name);
+	void close_source();
+	int stat_source(File_Stat *st, bool at_path);
+	void watch_source();
+	bool tail_unchanged();
+	int refresh_source();
+
+	void open_stream();
+	void read_stream(Chunk_List *list);
+	void close_stream();
+	int64_t read_input(char *buf, int64_t len);
+
+	int open_compressed();
+	void close_compressed();
+	int64_t read_at(int64_t offset, char *buf, int64_t len);
+
+	int refresh_mapping(int64_t new_size);
+	char *map_range(int64_t offset, int64_t len);
+	void unmap_range(char *ptr, int64_t len);
+	void advise(int64_t offset, int64_t len, int advice);
+
+	void note_viewport(int64_t start, int64_t end);
+
+	// Returns a pointer to the byte at 'offset' and the number of bytes that can be read from it in *avail.
+	// The pointer stays valid until the next call to get_span() or at().
+	const char *get_span(int64_t offset, int64_t *avail);
+
+	// Same as get_span() but for the unedited source, returning the whole contiguous block around 'offset'
+	const char *get_source_block(int64_t offset, int64_t *start, int64_t *len);
+
+	// Thread-safe alternative to get_span() for background readers. 'offset' must be a multiple of FILE_CHUNK_SIZE.
+	const char *acquire_range(int64_t offset, int64_t len);
+	void release_range(const char *ptr, int64_t len);
+
+	char at(int64_t offset) {
+		if (offset >= span_start && offset < span_start + span_len)
+			return span_ptr[offset - span_start];
+
+		int64_t avail;
+		const char *p = get_span(offset, &avail);
+		return p ? *p : 0;
+	}
+
+	// Characters are UTF-8, so these step over whole sequences
+	uint32_t decode_char(int64_t offset, int64_t *next);
+	int64_t next_char(int64_t offset);
+	int64_t prev_char(int64_t offset);
+	int64_t count_columns_between(int64_t from, int64_t to, int spaces_per_tab);
+
+	int64_t find_line(int64_t line, int64_t hint_line, int64_t hint_offset, int64_t *found_line);
+	int64_t find_line_of(int64_t offset, int64_t hint_line, int64_t hint_offset, int64_t *line_start);
+
+	void nearest_line(int64_t line, int64_t& found_line, int64_t& found_offset);
+	void nearest_offset(int64_t offset, int64_t& found_line, int64_t& found_offset);
+	int64_t source_line_of(int64_t offset);
+
+	int insert(int64_t offset, const char *text, int64_t len);
+	int remove(int64_t offset, int64_t len);
+	int insert_pieces(int64_t offset, const Piece_Ref *refs, int n_refs);
+
+	int undo(int64_t *first, int64_t *cursor);
+	int redo(int64_t *first, int64_t *cursor);
+
+	// Starts writing the current text to 'path' in the background. Returns a negative number if a save is already running.
+	int save_as(const char *path);
+	void save_worker();
+	void finish_save();
+	int64_t read_source(int64_t offset, char *buf, int64_t len);
+
+	int create_output(const char *temp_path);
+	int64_t write_output(const char *buf, int64_t len);
+	int64_t copy_to_output(int64_t offset, int64_t len); // returns 0 if the OS can't copy between the files directly
+	int close_output(bool keep);
 };
 
 struct Syntax_Mode {
@@ -91,11 +497,12 @@ struct Formatter {
 
 	int cur_mode;
 
+	// fore and back are indices into colors
 	void get_current_attrs(uint32_t& fore, uint32_t& back, uint32_t& glyph_off, uint32_t& modifier) {
 		Syntax_Mode& mode = modes[cur_mode];
-		fore = colors[mode.fore_color_idx];
-		back = colors[mode.back_color_idx];
-		glyph_off = mode.glyphset * 0x60;
+		fore = mode.fore_color_idx;
+		back = mode.back_color_idx;
+		glyph_off = mode.glyphset * GLYPHSET_SIZE;
 		modifier = mode.modifier;
 	}
 
@@ -120,11 +527,69 @@ struct Input_State {
 	}
 };
 
+// Colours are indices into Formatter::colors, which the GPU keeps its own copy of
+#define CELL_COLOR_BITS    5
+#define CELL_MODIFIER_SHIFT (2 * CELL_COLOR_BITS)
+
 struct Cell {
-	uint32_t glyph;
-	uint32_t modifier;
-	uint32_t foreground;
-	uint32_t background;
+	uint16_t glyph;
+	uint16_t attrs; // foreground | background << 5 | modifier << 10
+};
+
+static inline uint16_t cell_attrs(uint32_t fore, uint32_t back, uint32_t modifier) {
+	uint32_t mask = (1 << CELL_COLOR_BITS) - 1;
+	return (uint16_t)((fore & mask) | ((back & mask) << CELL_COLOR_BITS) | (modifier << CELL_MODIFIER_SHIFT));
+}
+
+#define MAX_DAMAGE_RANGES 16
+
+// Rows [start, end)
+struct Row_Range {
+	int start;
+	int end;
+};
+
+// Which rows changed since the last frame that was shown, sorted and never touching each other.
+// Past MAX_DAMAGE_RANGES, the two ranges with the smallest gap between them get merged.
+struct Damage {
+	Row_Range ranges[MAX_DAMAGE_RANGES];
+	int n_ranges;
+	bool full;
+
+	void clear() {
+		n_ranges = 0;
+		full = false;
+	}
+	bool empty() const {
+		return !full && n_ranges == 0;
+	}
+
+	void add(int start, int end);
+	void merge(const Damage& other);
+	void shift(int n, int rows);
+};
+
+// The cells of the frame being built and of the last one that was shown, kept in ordinary memory so that they can be compared.
+// render_into() writes into the buffer from begin(), diff() works out which rows changed, then swap() makes it the previous frame.
+// first_row is the line at the top of the grid, so that diff() can tell how far it scrolled.
+struct Cell_Shadow {
+	Cell *cur;
+	Cell *prev;
+	int rows;
+	int cols;
+	int cap;
+	int64_t first_row;
+	int64_t prev_first_row;
+	bool has_prev;
+
+	Cell *begin(int n_rows, int n_cols, int64_t top_row);
+	int diff(Damage& damage);
+	void swap();
+	void destroy();
+
+	void invalidate() {
+		has_prev = false;
+	}
 };
 
 struct Grid {
@@ -148,12 +613,18 @@ struct Grid {
 
 	int64_t grid_offset;
 	int64_t end_grid_offset;
-	// Vector<int64_t> line_offsets;
 
-	void render_into(File *file, Cell *cells, Formatter *formatter, Input_State& mouse, int wnd_width, int wnd_height);
+	void render_into(File *file, Cell *cells, Formatter *formatter, Glyph_Cache *glyphs, Input_State& mouse, int wnd_width, int wnd_height);
 	void move_cursor_vertically(File *file, int dir, int target_col);
 	void adjust_offsets(File *file, int64_t move_down, int64_t move_right);
 	int64_t jump_to_offset(File *file, int64_t offset, int flags);
+
+	void restore_view(File *file);
+	void after_edit(File *file, int64_t first, int64_t cursor);
+	void replace_range(File *file, int64_t start, int64_t end, const char *text, int64_t len);
+	void insert_text(File *file, const char *text, int64_t len);
+	void erase(File *file, int dir);
+	void undo(File *file, bool redo);
 };
 
 struct View {
@@ -44,15 +44,15 @@ VKAPI_ATTR VkBool32 VKAPI_CALL debug_callback_func(
 void Vulkan::close() {
 	vkDeviceWaitIdle(device);
 
-	DESTROY(vkDestroySemaphore, device, sema_present, nullptr)
-	DESTROY(vkDestroySemaphore, device, sema_render, nullptr)
+	for (int i = 0; i < FRAMES_IN_FLIGHT; i++) {
+		DESTROY(vkDestroySemaphore, device, frames[i].sema_present, nullptr)
+		DESTROY(vkDestroyFence, device, frames[i].fence, nullptr)
+	}
 
 	DESTROY(vkDestroyShaderModule, device, vert_shader, nullptr)
 	DESTROY(vkDestroyShaderModule, device, frag_shader, nullptr)
 
-	DESTROY(vkDestroyFence, device, draw_fence, nullptr)
-	DESTROY(vkDestroyFramebuffer, device, framebuffer, nullptr)
-	DESTROY(vkDestroyImageView, device, swap_image_view, nullptr)
+	destroy_swap_images();
 
 	DESTROY(vkDestroyCommandPool, device, cmd_pool, nullptr)
 
@@ -63,13 +63,26 @@ void Vulkan::close() {
 	DESTROY(vkDestroyPipeline, device, pipeline, nullptr)
 	DESTROY(vkDestroyRenderPass, device, renderpass, nullptr)
 
-	grids_pool.close(device);
-	glyphset_pool.close(device);
+	free_pool(grids_pool);
+	free_pool(glyphset_pool);
+
+	DESTROY(vkDestroySampler, device, glyph_sampler, nullptr)
+	DESTROY(vkDestroyImageView, device, glyph_image_view, nullptr)
+	DESTROY(vkDestroyImage, device, glyph_image, nullptr)
+	free_memory(glyph_image_mem);
+	DESTROY(vkDestroyQueryPool, device, timestamp_pool, nullptr)
 
 	DESTROY(DestroySwapchainKHR, device, swapchain, nullptr)
 
 	DESTROY(vkDestroyFence, device, misc_fence, nullptr)
 
+	// Freeing a block unmaps it too
+	for (int i = 0; i < n_mem_blocks; i++) {
+		vkFreeMemory(device, mem_blocks[i].mem, nullptr);
+		mem_blocks[i].destroy();
+	}
+	n_mem_blocks = 0;
+
 	vkDestroyDevice(device, nullptr);
 
 	DestroyDebugUtilsMessenger(instance, debug_callback, nullptr);
@@ -148,6 +161,7 @@ int Vulkan::load_khr_extensions() {
 	khr_table[ID_GetPhysicalDeviceSurfaceSupport] = vkGetInstanceProcAddr(instance, "vkGetPhysicalDeviceSurfaceSupportKHR");
 	khr_table[ID_GetPhysicalDeviceSurfaceCapabilities] = vkGetInstanceProcAddr(instance, "vkGetPhysicalDeviceSurfaceCapabilitiesKHR");
 	khr_table[ID_GetPhysicalDeviceSurfaceFormats] = vkGetInstanceProcAddr(instance, "vkGetPhysicalDeviceSurfaceFormatsKHR");
+	khr_table[ID_GetPhysicalDeviceSurfacePresentModes] = vkGetInstanceProcAddr(instance, "vkGetPhysicalDeviceSurfacePresentModesKHR");
 
 	khr_table[ID_CreateDebugUtilsMessenger] = vkGetInstanceProcAddr(instance, "vkCreateDebugUtilsMessengerEXT");
 	khr_table[ID_DestroyDebugUtilsMessenger] = vkGetInstanceProcAddr(instance, "vkDestroyDebugUtilsMessengerEXT");
@@ -205,13 +219,45 @@ int Vulkan::select_bgra8_surface_format() {
 	return sf_color_fmt.format == VK_FORMAT_UNDEFINED ? -3 : 0;
 }
 
+const char *present_mode_name(VkPresentModeKHR mode) {
+	switch (mode) {
+		case VK_PRESENT_MODE_IMMEDIATE_KHR: return "immediate";
+		case VK_PRESENT_MODE_MAILBOX_KHR:   return "mailbox";
+		case VK_PRESENT_MODE_FIFO_KHR:      return "fifo";
+		default:                            return "other";
+	}
+}
+
+// FIFO is the only mode every surface has to support, so anything else that isn't available falls back to it
+void Vulkan::select_present_mode() {
+	VkPresentModeKHR modes[16];
+	uint32_t n_modes = 16;
+	VkResult res = GetPhysicalDeviceSurfacePresentModesKHR(gpu, surface, &n_modes, modes);
+	if (res != VK_SUCCESS && res != VK_INCOMPLETE)
+		n_modes = 0;
+
+	for (int i = 0; i < n_modes; i++) {
+		if (modes[i] == present_mode)
+			return;
+	}
+
+	fprintf(stderr, "Present mode \"%s\" isn't supported, using fifo instead\n", present_mode_name(present_mode));
+	present_mode = VK_PRESENT_MODE_FIFO_KHR;
+}
+
 VkResult Vulkan::create_swapchain() {
+	uint32_t n_images = SWAPCHAIN_IMAGES;
+	if (n_images < sf_caps.minImageCount)
+		n_images = sf_caps.minImageCount;
+	if (sf_caps.maxImageCount > 0 && n_images > sf_caps.maxImageCount)
+		n_images = sf_caps.maxImageCount;
+
 	VkSwapchainCreateInfoKHR swap_info = {
 		.sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR,
 		.pNext = nullptr,
 		.flags = 0,
 		.surface = surface,
-		.minImageCount = 1,
+		.minImageCount = n_images,
 		.imageFormat = sf_color_fmt.format,
 		.imageColorSpace = sf_color_fmt.colorSpace,
 		.imageExtent = sf_caps.currentExtent,
@@ -222,7 +268,7 @@ VkResult Vulkan::create_swapchain() {
 		.pQueueFamilyIndices = nullptr,
 		.preTransform = (VkSurfaceTransformFlagBitsKHR)sf_caps.currentTransform,
 		.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR,
-		.presentMode = VK_PRESENT_MODE_IMMEDIATE_KHR,
+		.presentMode = present_mode,
 		.clipped = VK_TRUE,
 		.oldSwapchain = nullptr
 	};
@@ -275,8 +321,13 @@ int Vulkan::create_command_pool_and_draw_buffers() {
 		.commandBufferCount = 1
 	};
 
-	res = vkAllocateCommandBuffers(device, &cbuf_alloc_info, &draw_buffer);
-	return res != VK_SUCCESS ? -2 : 0;
+	for (int i = 0; i < FRAMES_IN_FLIGHT; i++) {
+		res = vkAllocateCommandBuffers(device, &cbuf_alloc_info, &frames[i].cmd);
+		if (res != VK_SUCCESS)
+			return -2;
+	}
+
+	return 0;
 }
 
 VkResult Vulkan::create_renderpass() {
@@ -339,29 +390,67 @@ VkResult Vulkan::create_renderpass() {
 	return vkCreateRenderPass(device, &pass_info, nullptr, &renderpass);
 }
 
-VkResult Vulkan::create_framebuffer() {
-	VkFramebufferCreateInfo fb_info = {
-		.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO,
-		.renderPass = renderpass,
-		.attachmentCount = 1,
-		.pAttachments = &swap_image_view,
-		.width = sf_caps.currentExtent.width,
-		.height = sf_caps.currentExtent.height,
-		.layers = 1
+// Makes a view, a framebuffer and a render-finished semaphore for each image in the swapchain
+int Vulkan::create_swap_images() {
+	uint32_t n_images = 0;
+	VkResult res = GetSwapchainImagesKHR(device, swapchain, &n_images, nullptr);
+		FAIL_IF(res != VK_SUCCESS || n_images == 0 || n_images > MAX_SWAP_IMAGES, "Could not get swapchain images (n_images=%d, res=%d)\n", n_images, res)
+
+	res = GetSwapchainImagesKHR(device, swapchain, &n_images, swap_images);
+		FAIL_IF(res != VK_SUCCESS, "Could not get swapchain images (%d)\n", res)
+
+	n_swap_images = n_images;
+
+	VkSemaphoreCreateInfo sema_info = {
+		.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO
 	};
 
-	return vkCreateFramebuffer(device, &fb_info, nullptr, &framebuffer);
+	for (int i = 0; i < n_swap_images; i++) {
+		VkImageViewCreateInfo iv_info = make_imageview_info(&swap_images[i], sf_color_fmt.format, VK_IMAGE_ASPECT_COLOR_BIT);
+		res = vkCreateImageView(device, &iv_info, nullptr, &swap_image_views[i]);
+			FAIL_IF(res != VK_SUCCESS, "vkCreateImageView() failed (%d)\n", res)
+
+		VkFramebufferCreateInfo fb_info = {
+			.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO,
+			.renderPass = renderpass,
+			.attachmentCount = 1,
+			.pAttachments = &swap_image_views[i],
+			.width = sf_caps.currentExtent.width,
+			.height = sf_caps.currentExtent.height,
+			.layers = 1
+		};
+
+		res = vkCreateFramebuffer(device, &fb_info, nullptr, &framebuffers[i]);
+			FAIL_IF(res != VK_SUCCESS, "vkCreateFramebuffer() failed (%d)\n", res)
+
+		res = vkCreateSemaphore(device, &sema_info, nullptr, &swap_sema_render[i]);
+			FAIL_IF(res != VK_SUCCESS, "vkCreateSemaphore() failed (%d)\n", res)
+	}
+
+	return 0;
+}
+
+void Vulkan::destroy_swap_images() {
+	for (int i = 0; i < n_swap_images; i++) {
+		DESTROY(vkDestroyFramebuffer, device, framebuffers[i], nullptr)
+		DESTROY(vkDestroyImageView, device, swap_image_views[i], nullptr)
+		DESTROY(vkDestroySemaphore, device, swap_sema_render[i], nullptr)
+	}
+
+	n_swap_images = 0;
 }
 
 VkResult Vulkan::create_semaphores() {
 	VkSemaphoreCreateInfo bake_sema = {};
 	bake_sema.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
 
-	VkResult res = vkCreateSemaphore(device, &bake_sema, nullptr, &sema_present);
-	if (res != VK_SUCCESS)
-		return res;
+	for (int i = 0; i < FRAMES_IN_FLIGHT; i++) {
+		VkResult res = vkCreateSemaphore(device, &bake_sema, nullptr, &frames[i].sema_present);
+		if (res != VK_SUCCESS)
+			return res;
+	}
 
-	return vkCreateSemaphore(device, &bake_sema, nullptr, &sema_render);
+	return VK_SUCCESS;
 }
 
 void Vulkan::create_fences() {
@@ -371,7 +460,11 @@ void Vulkan::create_fences() {
 	};
 
 	vkCreateFence(device, &fence_info, nullptr, &misc_fence);
-	vkCreateFence(device, &fence_info, nullptr, &draw_fence);
+	// None of the grid regions have anything in them yet
+	for (int i = 0; i < FRAMES_IN_FLIGHT; i++) {
+		vkCreateFence(device, &fence_info, nullptr, &frames[i].fence);
+		frames[i].damage.full = true;
+	}
 }
 
 int init_vulkan(Vulkan& vk, VkShaderModuleCreateInfo& vert_shader_buf, VkShaderModuleCreateInfo& frag_shader_buf, int width, int height) {
@@ -395,6 +488,7 @@ int init_vulkan(Vulkan& vk, VkShaderModuleCreateInfo& vert_shader_buf, VkShaderM
 		FAIL_IF(res != VK_SUCCESS, "vkEnumeratePhysicalDevices() failed (%d)\n", res)
 
 	vkGetPhysicalDeviceMemoryProperties(vk.gpu, &vk.gpu_mem);
+	vkGetPhysicalDeviceProperties(vk.gpu, &vk.gpu_props);
 
 	uint32_t n_dev_exts = 0;
 	res = vkEnumerateDeviceExtensionProperties(vk.gpu, nullptr, &n_dev_exts, nullptr);
@@ -407,8 +501,11 @@ int init_vulkan(Vulkan& vk, VkShaderModuleCreateInfo& vert_shader_buf, VkShaderM
 	res = vkEnumerateDeviceExtensionProperties(vk.gpu, nullptr, &n_dev_exts, dev_ext_props);
 		FAIL_IF(res != VK_SUCCESS, "vkEnumerateDeviceExtensionProperties() failed (%d)\n", res)
 
-	for (int i = 0; i < n_dev_exts; i++)
+	for (int i = 0; i < n_dev_exts; i++) {
 		dev_exts[i] = &dev_ext_props[i].extensionName[0];
+		if (!strcmp(dev_exts[i], VK_KHR_INCREMENTAL_PRESENT_EXTENSION_NAME))
+			vk.has_incremental_present = true;
+	}
 
 	res = vk.create_device(dev_exts, n_dev_exts);
 		FAIL_IF(res != VK_SUCCESS, "vkCreateDevice() failed (%d)\n", res)
@@ -447,30 +544,26 @@ int init_vulkan(Vulkan& vk, VkShaderModuleCreateInfo& vert_shader_buf, VkShaderM
 	vk.sf_caps.currentExtent.height = vk.wnd_height;
 		FAIL_IF(res != VK_SUCCESS, "vkGetPhysicalDeviceSurfaceCapabilitiesKHR() failed (%d)\n", res)
 
+	vk.select_present_mode();
+
 	res = vk.create_swapchain();
 		FAIL_IF(res != VK_SUCCESS, "vkCreateSwapchainKHR() failed (%d)\n", res)
 
-	uint32_t n_images = 1;
-	res = vk.GetSwapchainImagesKHR(vk.device, vk.swapchain, &n_images, &vk.swap_image);
-		FAIL_IF(n_images != 1 || res != VK_SUCCESS, "Could not acquire swapchain image (n_images=%d, res=%d)\n", n_images, res)
-
-	VkImageViewCreateInfo iv_info = make_imageview_info(&vk.swap_image, vk.sf_color_fmt.format, VK_IMAGE_ASPECT_COLOR_BIT);
-	res = vkCreateImageView(vk.device, &iv_info, nullptr, &vk.swap_image_view);
-		FAIL_IF(res != VK_SUCCESS, "vkCreateImageView() failed (%d)\n", res)
-
 	failure = vk.create_command_pool_and_draw_buffers();
 		FAIL_IF(failure != 0, "create_command_pool_and_buffers() failed (%d)\n", res)
 
 	res = vk.create_renderpass();
 		FAIL_IF(res != VK_SUCCESS, "vkCreateRenderPass() failed (%d)\n", res)
 
-	res = vk.create_framebuffer();
-		FAIL_IF(res != VK_SUCCESS, "vkCreateFramebuffer() failed (%d)\n", res)
+	failure = vk.create_swap_images();
+	if (failure != 0)
+		return failure;
 
 	res = vk.create_semaphores();
 		FAIL_IF(res != VK_SUCCESS, "Failed to create Vulkan semaphores\n")
 
 	vk.create_fences();
+	vk.create_timestamp_queries();
 	return 0;
 }
 
@@ -483,9 +576,241 @@ int get_memory_type(VkPhysicalDeviceMemoryProperties& gpu_mem, uint32_t mem_req_
 	return -1;
 }
 
-// TODO: Custom allocator to use with both glyphsets and grids
+#define GPU_FREE_LIST_INITIAL_CAP 16
+
+void Gpu_Block::init(int64_t block_size) {
+	size = block_size;
+	used = 0;
+	n_allocs = 0;
+
+	free_cap = GPU_FREE_LIST_INITIAL_CAP;
+	free_list = new Gpu_Range[free_cap];
+	free_list[0] = {0, block_size};
+	n_free = 1;
+}
+
+void Gpu_Block::insert_free(int idx, Gpu_Range r) {
+	if (n_free >= free_cap) {
+		auto list = new Gpu_Range[free_cap * 2];
+		memcpy(list, free_list, n_free * sizeof(Gpu_Range));
+		delete[] free_list;
+		free_list = list;
+		free_cap *= 2;
+	}
+
+	memmove(&free_list[idx+1], &free_list[idx], (n_free - idx) * sizeof(Gpu_Range));
+	free_list[idx] = r;
+	n_free++;
+}
+
+// First fit. Returns the offset of the new range, or -1 if nothing's big enough. align has to be a power of two.
+int64_t Gpu_Block::take(int64_t len, int64_t align) {
+	for (int i = 0; i < n_free; i++) {
+		Gpu_Range& r = free_list[i];
+		int64_t start = (r.offset + align - 1) & ~(align - 1);
+		int64_t end = r.offset + r.size;
+		if (start + len > end)
+			continue;
+
+		if (start == r.offset && start + len == end) {
+			memmove(&free_list[i], &free_list[i+1], (n_free - i - 1) * sizeof(Gpu_Range));
+			n_free--;
+		}
+		else if (start == r.offset) {
+			r.offset += len;
+			r.size -= len;
+		}
+		else {
+			// Whatever the alignment skipped over stays free
+			r.size = start - r.offset;
+			if (start + len < end)
+				insert_free(i + 1, {start + len, end - start - len});
+		}
+
+		used += len;
+		n_allocs++;
+		return start;
+	}
+
+	return -1;
+}
+
+void Gpu_Block::give_back(int64_t offset, int64_t len) {
+	used -= len;
+	n_allocs--;
+
+	int i = 0;
+	while (i < n_free && free_list[i].offset < offset)
+		i++;
+
+	bool join_prev = i > 0 && free_list[i-1].offset + free_list[i-1].size == offset;
+	bool join_next = i < n_free && offset + len == free_list[i].offset;
+
+	if (join_prev && join_next) {
+		free_list[i-1].size += len + free_list[i].size;
+		memmove(&free_list[i], &free_list[i+1], (n_free - i - 1) * sizeof(Gpu_Range));
+		n_free--;
+	}
+	else if (join_prev) {
+		free_list[i-1].size += len;
+	}
+	else if (join_next) {
+		free_list[i].offset = offset;
+		free_list[i].size += len;
+	}
+	else {
+		insert_free(i, {offset, len});
+	}
+}
+
+void Gpu_Block::destroy() {
+	delete[] free_list;
+	free_list = nullptr;
+	n_free = free_cap = 0;
+}
+
+// Carves memory out of a block of the right type if one has room, otherwise allocates a new block.
+// Blocks stay around until the device is closed. On failure the returned allocation's block is -1.
+Gpu_Alloc Vulkan::alloc_memory(VkMemoryRequirements& reqs, uint32_t mem_flags) {
+	Gpu_Alloc a = {0};
+	a.block = -1;
+
+	int mem_type = get_memory_type(gpu_mem, reqs.memoryTypeBits, mem_flags);
+	if (mem_type < 0)
+		return a;
+
+	// Buffers and optimally tiled images in the same block have to be at least bufferImageGranularity apart
+	int64_t gran = (int64_t)gpu_props.limits.bufferImageGranularity;
+	if (gran < 1)
+		gran = 1;
+
+	int64_t align = (int64_t)reqs.alignment > gran ? (int64_t)reqs.alignment : gran;
+	int64_t len = ((int64_t)reqs.size + gran - 1) & ~(gran - 1);
+
+	int idx = -1;
+	int64_t offset = -1;
+	for (int i = 0; i < n_mem_blocks && offset < 0; i++) {
+		if (mem_blocks[i].mem_type == mem_type) {
+			offset = mem_blocks[i].take(len, align);
+			idx = i;
+		}
+	}
+
+	if (offset < 0) {
+		if (n_mem_blocks >= GPU_MAX_BLOCKS)
+			return a;
+
+		VkMemoryAllocateInfo alloc_info = {
+			.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+			.allocationSize = (VkDeviceSize)(len > GPU_BLOCK_SIZE ? len : GPU_BLOCK_SIZE),
+			.memoryTypeIndex = (uint32_t)mem_type
+		};
+
+		// Small heaps, like a BAR that can't be resized, might not have room for a whole block
+		VkDeviceMemory mem;
+		if (vkAllocateMemory(device, &alloc_info, nullptr, &mem) != VK_SUCCESS) {
+			alloc_info.allocationSize = (VkDeviceSize)len;
+			if (vkAllocateMemory(device, &alloc_info, nullptr, &mem) != VK_SUCCESS)
+				return a;
+		}
+
+		idx = n_mem_blocks++;
+		Gpu_Block& b = mem_blocks[idx];
+		b.init((int64_t)alloc_info.allocationSize);
+		b.mem = mem;
+		b.mem_type = mem_type;
+		b.mapped = nullptr;
+
+		// Each block is mapped once for as long as it lives, since memory can't be mapped twice at the same time
+		if (gpu_mem.memoryTypes[mem_type].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+			if (vkMapMemory(device, mem, 0, VK_WHOLE_SIZE, 0, (void**)&b.mapped) != VK_SUCCESS)
+				b.mapped = nullptr;
+		}
+
+		offset = b.take(len, align);
+	}
+
+	Gpu_Block& b = mem_blocks[idx];
+	a.mem = b.mem;
+	a.ptr = b.mapped ? &b.mapped[offset] : nullptr;
+	a.offset = offset;
+	a.size = len;
+	a.block = idx;
+	return a;
+}
+
+void Vulkan::free_memory(Gpu_Alloc& a) {
+	if (!a.mem || a.block < 0 || a.block >= n_mem_blocks)
+		return;
+
+	mem_blocks[a.block].give_back(a.offset, a.size);
+	a = {0};
+	a.block = -1;
+}
+
+Gpu_Stats Vulkan::get_memory_stats() {
+	Gpu_Stats stats = {0};
+	stats.n_blocks = n_mem_blocks;
+
+	for (int i = 0; i < n_mem_blocks; i++) {
+		Gpu_Block& b = mem_blocks[i];
+		stats.n_allocs += b.n_allocs;
+		stats.n_free_ranges += b.n_free;
+		stats.reserved += b.size;
+		stats.used += b.used;
+
+		for (int j = 0; j < b.n_free; j++) {
+			if (b.free_list[j].size > stats.largest_free)
+				stats.largest_free = b.free_list[j].size;
+		}
+	}
+
+	return stats;
+}
+
+// Integrated GPUs, resizable BAR and software drivers have memory that's both device local and mappable.
+// A buffer in there is written by the CPU and read by the shader without a staging copy in between.
+Memory_Pool Vulkan::allocate_direct_memory(int size) {
+	Memory_Pool pool = {0};
+
+	VkBufferCreateInfo buf_info = {
+		.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+		.size = (VkDeviceSize)size,
+		.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
+	};
+
+	VkBuffer buf;
+	if (vkCreateBuffer(device, &buf_info, nullptr, &buf) != VK_SUCCESS)
+		return pool;
+
+	VkMemoryRequirements mem_reqs;
+	vkGetBufferMemoryRequirements(device, buf, &mem_reqs);
+
+	Gpu_Alloc mem = alloc_memory(mem_reqs, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+
+	if (mem.block < 0 || !mem.ptr || vkBindBufferMemory(device, buf, mem.mem, mem.offset) != VK_SUCCESS) {
+		free_memory(mem);
+		vkDestroyBuffer(device, buf, nullptr);
+		return pool;
+	}
+
+	pool.host_buf = pool.dev_buf = buf;
+	pool.host_alloc = pool.dev_alloc = mem;
+	pool.staging_area = mem.ptr;
+	pool.size = size;
+	pool.direct = true;
+	return pool;
+}
+
+// If allow_direct is set and there's suitable memory, the pool's staging area is the device buffer itself.
+// Otherwise it's a separate host buffer that gets copied over.
+Memory_Pool Vulkan::allocate_gpu_memory(int size, bool allow_direct) {
+	if (allow_direct) {
+		Memory_Pool direct_pool = allocate_direct_memory(size);
+		if (direct_pool.direct)
+			return direct_pool;
+	}
 
-Memory_Pool Vulkan::allocate_gpu_memory(int size) {
 	Memory_Pool pool = {0};
 
 	VkBufferCreateInfo host_buf_info = {
@@ -500,24 +825,15 @@ Memory_Pool Vulkan::allocate_gpu_memory(int size) {
 	VkMemoryRequirements host_mem_reqs;
 	vkGetBufferMemoryRequirements(device, pool.host_buf, &host_mem_reqs);
 
-	int host_mem_type = get_memory_type(gpu_mem, host_mem_reqs.memoryTypeBits, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
-		FAIL_IF_STRUCT(host_mem_type < 0, "Could not find a suitable memory type for the host buffer\n")
+	pool.size = size;
 
-	pool.size = host_mem_reqs.size;
+	pool.host_alloc = alloc_memory(host_mem_reqs, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+		FAIL_IF_STRUCT(pool.host_alloc.block < 0, "Could not allocate host memory\n")
+		FAIL_IF_STRUCT(!pool.host_alloc.ptr, "Could not map host memory\n")
 
-	VkMemoryAllocateInfo host_alloc_info = {
-		.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-		.allocationSize = host_mem_reqs.size,
-		.memoryTypeIndex = (uint32_t)host_mem_type
-	};
-
-	res = vkAllocateMemory(device, &host_alloc_info, nullptr, &pool.host_mem);
-		FAIL_IF_STRUCT(res != VK_SUCCESS, "Could not allocate host memory [vkAllocateMemory() -> %d]\n", res)
-
-	res = vkMapMemory(device, pool.host_mem, 0, host_alloc_info.allocationSize, 0, (void**)&pool.staging_area);
-		FAIL_IF_STRUCT(res != VK_SUCCESS, "Could not map host memory [vkMapMemory() -> %d]\n", res)
+	pool.staging_area = pool.host_alloc.ptr;
 
-	res = vkBindBufferMemory(device, pool.host_buf, pool.host_mem, 0);
+	res = vkBindBufferMemory(device, pool.host_buf, pool.host_alloc.mem, pool.host_alloc.offset);
 		FAIL_IF_STRUCT(res != VK_SUCCESS, "Could not bind host memory [vkBindBufferMemory() -> %d]\n", res)
 
 	VkBufferCreateInfo dev_buf_info = host_buf_info;
@@ -529,23 +845,40 @@ Memory_Pool Vulkan::allocate_gpu_memory(int size) {
 	VkMemoryRequirements dev_mem_reqs;
 	vkGetBufferMemoryRequirements(device, pool.dev_buf, &dev_mem_reqs);
 
-	int dev_mem_type = get_memory_type(gpu_mem, dev_mem_reqs.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-		FAIL_IF_STRUCT(dev_mem_type < 0, "Could not find a suitable memory type for the device buffer\n")
-
-	VkMemoryAllocateInfo dev_alloc_info = host_alloc_info;
-	dev_alloc_info.allocationSize = dev_mem_reqs.size;
-	dev_alloc_info.memoryTypeIndex = (uint32_t)dev_mem_type;
-
-	res = vkAllocateMemory(device, &dev_alloc_info, nullptr, &pool.dev_mem);
-		FAIL_IF_STRUCT(res != VK_SUCCESS, "Could not allocate device memory [vkAllocateMemory() -> %d]\n", res)
+	pool.dev_alloc = alloc_memory(dev_mem_reqs, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+		FAIL_IF_STRUCT(pool.dev_alloc.block < 0, "Could not allocate device memory\n")
 
-	res = vkBindBufferMemory(device, pool.dev_buf, pool.dev_mem, 0);
+	res = vkBindBufferMemory(device, pool.dev_buf, pool.dev_alloc.mem, pool.dev_alloc.offset);
 		FAIL_IF_STRUCT(res != VK_SUCCESS, "Could not bind device memory [vkBindBufferMemory() -> %d]\n", res)
 
 	return pool;
 }
 
+void Vulkan::free_pool(Memory_Pool& pool) {
+	if (!pool.size)
+		return;
+
+	vkDestroyBuffer(device, pool.dev_buf, nullptr);
+	free_memory(pool.dev_alloc);
+
+	if (!pool.direct) {
+		vkDestroyBuffer(device, pool.host_buf, nullptr);
+		free_memory(pool.host_alloc);
+	}
+
+	pool = {0};
+}
+
 int Vulkan::push_to_gpu(Memory_Pool& pool, int offset, int size) {
+	VkBufferCopy copy_info = {
+		.srcOffset = (VkDeviceSize)offset,
+		.dstOffset = (VkDeviceSize)offset,
+		.size = (VkDeviceSize)size
+	};
+	return push_ranges_to_gpu(pool, &copy_info, 1);
+}
+
+VkCommandBuffer Vulkan::begin_transfer() {
 	VkCommandBufferAllocateInfo cbuf_alloc_info = {
 		.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
 		.commandPool = cmd_pool,
@@ -560,13 +893,35 @@ int Vulkan::push_to_gpu(Memory_Pool& pool, int offset, int size) {
 	};
 	vkBeginCommandBuffer(copy_cmd, &beg_info);
 
-	VkBufferCopy copy_info = {
-		.srcOffset = (VkDeviceSize)offset,
-		.dstOffset = (VkDeviceSize)offset,
-		.size = (VkDeviceSize)size
+	return copy_cmd;
+}
+
+// Copies several ranges from the staging area to the same offsets on the device with a single submit.
+// Frames that are still in flight might be reading what gets overwritten, so the copy waits for them.
+int Vulkan::push_ranges_to_gpu(Memory_Pool& pool, VkBufferCopy *ranges, int n_ranges) {
+	if (pool.direct)
+		return 0;
+
+	VkCommandBuffer copy_cmd = begin_transfer();
+
+	VkMemoryBarrier barrier = {
+		.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+		.srcAccessMask = VK_ACCESS_SHADER_READ_BIT,
+		.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT
 	};
-	vkCmdCopyBuffer(copy_cmd, pool.host_buf, pool.dev_buf, 1, &copy_info);
+	vkCmdPipelineBarrier(copy_cmd, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+	vkCmdCopyBuffer(copy_cmd, pool.host_buf, pool.dev_buf, (uint32_t)n_ranges, ranges);
 
+	barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+	vkCmdPipelineBarrier(copy_cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+	return end_transfer(copy_cmd);
+}
+
+// Submits a command buffer from begin_transfer() and waits for it to finish
+int Vulkan::end_transfer(VkCommandBuffer copy_cmd) {
 	vkEndCommandBuffer(copy_cmd);
 
 	VkResult res = vkResetFences(device, 1, &misc_fence);
@@ -591,20 +946,218 @@ int Vulkan::push_to_gpu(Memory_Pool& pool, int offset, int size) {
 	return 0;
 }
 
+// Makes the grid regions at least region_size bytes each. Whatever was in them is lost, including the palette.
+// Each frame only writes to a grid region the GPU is done with, so the cells can go straight into device memory if there's a way to map it.
+int Vulkan::resize_grids_pool(int region_size) {
+	int size = MIN_GRID_REGION_SIZE;
+	while (size < region_size)
+		size *= 2;
+
+	// Frames that are still in flight read from the old pool
+	if (grids_pool.size)
+		vkDeviceWaitIdle(device);
+
+	free_pool(grids_pool);
+	grid_region_size = 0;
+
+	grids_pool = allocate_gpu_memory(GRID_PALETTE_SIZE + size * FRAMES_IN_FLIGHT, true);
+	if (!grids_pool.size)
+		return __LINE__;
+
+	grid_region_size = size;
+
+	for (int i = 0; i < FRAMES_IN_FLIGHT; i++) {
+		frames[i].damage.full = true;
+		frames[i].grid_size = 0;
+		frames[i].n_grid_copies = 0;
+	}
+
+	// The first pool is made before the descriptor set, which then picks it up itself
+	if (desc_set)
+		write_grids_descriptor();
+
+	return 0;
+}
+
+void Vulkan::write_grids_descriptor() {
+	VkDescriptorBufferInfo grid_buf_info = {
+		.buffer = grids_pool.dev_buf,
+		.offset = 0,
+		.range = (VkDeviceSize)grids_pool.size
+	};
+
+	VkWriteDescriptorSet write_info = {
+		.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+		.dstSet = desc_set,
+		.dstBinding = 0,
+		.descriptorCount = 1,
+		.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+		.pBufferInfo = &grid_buf_info
+	};
+
+	vkUpdateDescriptorSets(device, 1, &write_info, 0, nullptr);
+}
+
+// Moves on to the next frame slot, waiting until the GPU is done with the last frame that used it.
+// Returns where the new frame's cells go in the staging area, or null if the wait failed or grid_size bytes don't fit in a region.
+uint8_t *Vulkan::begin_frame(int grid_size) {
+	if (grid_size > grid_region_size)
+		return nullptr;
+
+	cur_frame = (cur_frame + 1) % FRAMES_IN_FLIGHT;
+	Frame_Slot& f = frames[cur_frame];
+
+	VkResult res = vkWaitForFences(device, 1, &f.fence, VK_TRUE, MAX_64);
+	if (res != VK_SUCCESS)
+		return nullptr;
+
+	f.grid_offset = GRID_PALETTE_SIZE + cur_frame * grid_region_size;
+	f.grid_size = grid_size;
+	f.n_grid_copies = 0;
+	return &grids_pool.staging_area[f.grid_offset];
+}
+
+// The glyphs can also live in an R8 2D array image, one layer per glyph slot, so that the shader reads them through the texture cache.
+// A 1x1x1 image is made even when the glyphs are read from glyphset_pool instead, since the descriptor has to point at something.
+int Vulkan::create_glyph_image(int width, int height, int layers) {
+	VkImageCreateInfo img_info = {
+		.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+		.imageType = VK_IMAGE_TYPE_2D,
+		.format = VK_FORMAT_R8_UNORM,
+		.extent = { (uint32_t)width, (uint32_t)height, 1 },
+		.mipLevels = 1,
+		.arrayLayers = (uint32_t)layers,
+		.samples = VK_SAMPLE_COUNT_1_BIT,
+		.tiling = VK_IMAGE_TILING_OPTIMAL,
+		.usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+		.sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+		.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED
+	};
+
+	VkResult res = vkCreateImage(device, &img_info, nullptr, &glyph_image);
+		FAIL_IF(res != VK_SUCCESS, "Failed to create glyph image [vkCreateImage() -> %d]\n", res)
+
+	VkMemoryRequirements mem_reqs;
+	vkGetImageMemoryRequirements(device, glyph_image, &mem_reqs);
+
+	glyph_image_mem = alloc_memory(mem_reqs, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+		FAIL_IF(glyph_image_mem.block < 0, "Could not allocate glyph image memory\n")
+
+	res = vkBindImageMemory(device, glyph_image, glyph_image_mem.mem, glyph_image_mem.offset);
+		FAIL_IF(res != VK_SUCCESS, "Could not bind glyph image memory [vkBindImageMemory() -> %d]\n", res)
+
+	VkImageViewCreateInfo iv_info = {
+		.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+		.image = glyph_image,
+		.viewType = VK_IMAGE_VIEW_TYPE_2D_ARRAY,
+		.format = VK_FORMAT_R8_UNORM,
+		.subresourceRange = {
+			.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+			.baseMipLevel = 0,
+			.levelCount = 1,
+			.baseArrayLayer = 0,
+			.layerCount = (uint32_t)layers
+		}
+	};
+
+	res = vkCreateImageView(device, &iv_info, nullptr, &glyph_image_view);
+		FAIL_IF(res != VK_SUCCESS, "vkCreateImageView() failed for glyph image (%d)\n", res)
+
+	// Coverage is read with texelFetch(), so the filter only matters for distance fields
+	VkSamplerCreateInfo sampler_info = {
+		.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
+		.magFilter = VK_FILTER_LINEAR,
+		.minFilter = VK_FILTER_LINEAR,
+		.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST,
+		.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+		.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+		.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+		.maxLod = 0.0f
+	};
+
+	res = vkCreateSampler(device, &sampler_info, nullptr, &glyph_sampler);
+		FAIL_IF(res != VK_SUCCESS, "vkCreateSampler() failed (%d)\n", res)
+
+	glyph_extent = img_info.extent;
+	glyph_layers = layers;
+	glyph_image_ready = false;
+	return 0;
+}
+
+// Copies glyph slots from the glyphset staging area into the layers of the same number
+int Vulkan::push_glyphs_to_image(Memory_Pool& pool, const int *slots, int n_slots, int slot_size) {
+	VkImageMemoryBarrier barrier = {
+		.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+		.srcAccessMask = glyph_image_ready ? VK_ACCESS_SHADER_READ_BIT : (VkAccessFlags)0,
+		.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+		.oldLayout = glyph_image_ready ? VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL : VK_IMAGE_LAYOUT_UNDEFINED,
+		.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+		.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+		.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+		.image = glyph_image,
+		.subresourceRange = {
+			.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+			.baseMipLevel = 0,
+			.levelCount = 1,
+			.baseArrayLayer = 0,
+			.layerCount = (uint32_t)glyph_layers
+		}
+	};
+
+	VkCommandBuffer copy_cmd = begin_transfer();
+
+	VkPipelineStageFlags src_stage = glyph_image_ready ? VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT : VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+	vkCmdPipelineBarrier(copy_cmd, src_stage, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+	if (n_slots > 0) {
+		auto regions = (VkBufferImageCopy*)alloca(n_slots * sizeof(VkBufferImageCopy));
+
+		for (int i = 0; i < n_slots; i++) {
+			regions[i] = {
+				.bufferOffset = (VkDeviceSize)slots[i] * (VkDeviceSize)slot_size,
+				.imageSubresource = {
+					.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+					.mipLevel = 0,
+					.baseArrayLayer = (uint32_t)slots[i],
+					.layerCount = 1
+				},
+				.imageExtent = glyph_extent
+			};
+		}
+
+		vkCmdCopyBufferToImage(copy_cmd, pool.host_buf, glyph_image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, (uint32_t)n_slots, regions);
+	}
+
+	barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+	barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+	barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+	vkCmdPipelineBarrier(copy_cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+	glyph_image_ready = true;
+	return end_transfer(copy_cmd);
+}
+
 int Vulkan::create_descriptor_set() {
 	VkResult res;
 
 	if (!dpool) {
-		VkDescriptorPoolSize ps_info = {
-			.type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
-			.descriptorCount = 2
+		VkDescriptorPoolSize ps_info[] = {
+			{
+				.type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+				.descriptorCount = 2
+			},
+			{
+				.type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+				.descriptorCount = 1
+			}
 		};
 
 		VkDescriptorPoolCreateInfo dpool_info = {
 			.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
 			.maxSets = 1,
-			.poolSizeCount = 1,
-			.pPoolSizes = &ps_info
+			.poolSizeCount = 2,
+			.pPoolSizes = ps_info
 		};
 
 		res = vkCreateDescriptorPool(device, &dpool_info, nullptr, &dpool);
@@ -623,12 +1176,18 @@ int Vulkan::create_descriptor_set() {
 			.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
 			.descriptorCount = 1,
 			.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT
+		},
+		{
+			.binding = 2,
+			.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+			.descriptorCount = 1,
+			.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT
 		}
 	};
 
 	VkDescriptorSetLayoutCreateInfo ds_info = {
 		.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
-		.bindingCount = 2,
+		.bindingCount = 3,
 		.pBindings = ds_bindings
 	};
 
@@ -645,6 +1204,42 @@ int Vulkan::create_descriptor_set() {
 	res = vkAllocateDescriptorSets(device, &ds_alloc_info, &desc_set);
 		FAIL_IF(res != VK_SUCCESS, "vkAllocateDescriptorSets() failed (%d)\n", res)
 
+	// Written once here, since the set can't change while a frame that uses it is still in flight.
+	// The grids pool is the exception, which resize_grids_pool() waits for the GPU to be idle before pointing it at.
+	write_grids_descriptor();
+
+	VkDescriptorBufferInfo glyphset_buf_info = {
+		.buffer = glyphset_pool.dev_buf,
+		.offset = 0,
+		.range = (VkDeviceSize)glyphset_pool.size
+	};
+	VkDescriptorImageInfo glyph_image_info = {
+		.sampler = glyph_sampler,
+		.imageView = glyph_image_view,
+		.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL
+	};
+
+	VkWriteDescriptorSet write_info[] = {
+		{
+			.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+			.dstSet = desc_set,
+			.dstBinding = 1,
+			.descriptorCount = 1,
+			.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+			.pBufferInfo = &glyphset_buf_info
+		},
+		{
+			.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+			.dstSet = desc_set,
+			.dstBinding = 2,
+			.descriptorCount = 1,
+			.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+			.pImageInfo = &glyph_image_info
+		}
+	};
+
+	vkUpdateDescriptorSets(device, 2, write_info, 0, nullptr);
+
 	return 0;
 }
 
@@ -750,38 +1345,11 @@ int Vulkan::construct_pipeline() {
 	return 0;
 }
 
-int Vulkan::update_command_buffers() {
-	VkDescriptorBufferInfo grid_buf_info = {
-		.buffer = grids_pool.dev_buf,
-		.offset = 0,
-		.range = (VkDeviceSize)grids_pool.size
-	};
-	VkDescriptorBufferInfo glyphset_buf_info = {
-		.buffer = glyphset_pool.dev_buf,
-		.offset = 0,
-		.range = (VkDeviceSize)glyphset_pool.size
-	};
-
-	VkWriteDescriptorSet write_info[] = {
-		{
-			.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-			.dstSet = desc_set,
-			.dstBinding = 0,
-			.descriptorCount = 1,
-			.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
-			.pBufferInfo = &grid_buf_info
-		},
-		{
-			.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-			.dstSet = desc_set,
-			.dstBinding = 1,
-			.descriptorCount = 1,
-			.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
-			.pBufferInfo = &glyphset_buf_info
-		}
-	};
-
-	vkUpdateDescriptorSets(device, 2, write_info, 0, nullptr);
+// Records the current frame slot's command buffer: copying its cells to the device, then drawing every view into the given swapchain image
+int Vulkan::update_command_buffers(int image_idx) {
+	Frame_Slot& f = frames[cur_frame];
+	VkCommandBuffer cmd = f.cmd;
+	uint32_t query = (uint32_t)cur_frame * 2;
 
 	VkCommandBufferBeginInfo cbuf_info = {
 		.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO
@@ -794,7 +1362,7 @@ int Vulkan::update_command_buffers() {
 	VkRenderPassBeginInfo rp_info = {
 		.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
 		.renderPass = renderpass,
-		.framebuffer = framebuffer,
+		.framebuffer = framebuffers[image_idx],
 		.renderArea = {
 			.offset = { .x = 0, .y = 0 },
 			.extent = sf_caps.currentExtent
@@ -803,11 +1371,35 @@ int Vulkan::update_command_buffers() {
 		.pClearValues = &clear_value
 	};
 
-	vkBeginCommandBuffer(draw_buffer, &cbuf_info);
-	vkCmdBeginRenderPass(draw_buffer, &rp_info, VK_SUBPASS_CONTENTS_INLINE);
+	vkBeginCommandBuffer(cmd, &cbuf_info);
+
+	if (timestamp_pool) {
+		vkCmdResetQueryPool(cmd, timestamp_pool, query, 2);
+		vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, timestamp_pool, query);
+	}
+
+	// Each frame slot has its own region on the device too, so this can't clash with a frame that's still being drawn.
+	// With direct memory the cells are already there, and the submit makes them visible.
+	if (f.n_grid_copies > 0 && !grids_pool.direct) {
+		vkCmdCopyBuffer(cmd, grids_pool.host_buf, grids_pool.dev_buf, (uint32_t)f.n_grid_copies, f.grid_copies);
+
+		VkBufferMemoryBarrier barrier = {
+			.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+			.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+			.dstAccessMask = VK_ACCESS_SHADER_READ_BIT,
+			.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+			.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+			.buffer = grids_pool.dev_buf,
+			.offset = (VkDeviceSize)f.grid_offset,
+			.size = (VkDeviceSize)f.grid_size
+		};
+		vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, nullptr, 1, &barrier, 0, nullptr);
+	}
 
-	vkCmdBindDescriptorSets(draw_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pl_layout, 0, 1, &desc_set, 0, nullptr);
-	vkCmdBindPipeline(draw_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+	vkCmdBeginRenderPass(cmd, &rp_info, VK_SUBPASS_CONTENTS_INLINE);
+
+	vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, pl_layout, 0, 1, &desc_set, 0, nullptr);
+	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
 
 	for (int i = 0; i < n_view_params; i++) {
 		VkRect2D *scissor = &rp_info.renderArea;
@@ -819,33 +1411,38 @@ int Vulkan::update_command_buffers() {
 			.maxDepth = 1.0f
 		};
 
-		vkCmdSetViewport(draw_buffer, 0, 1, &viewport);
-		vkCmdSetScissor(draw_buffer, 0, 1, scissor);
+		vkCmdSetViewport(cmd, 0, 1, &viewport);
+		vkCmdSetScissor(cmd, 0, 1, scissor);
 
-		vkCmdPushConstants(draw_buffer, pl_layout, VK_SHADER_STAGE_FRAGMENT_BIT, 0, sizeof(View_Params), &view_params[i]);
+		vkCmdPushConstants(cmd, pl_layout, VK_SHADER_STAGE_FRAGMENT_BIT, 0, sizeof(View_Params), &view_params[i]);
 
-		vkCmdDraw(draw_buffer, 4, 1, 0, 1);
+		vkCmdDraw(cmd, 4, 1, 0, 1);
 	}
 
-	vkCmdEndRenderPass(draw_buffer);
-	vkEndCommandBuffer(draw_buffer);
+	vkCmdEndRenderPass(cmd);
+
+	if (timestamp_pool)
+		vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, timestamp_pool, query + 1);
+
+	vkEndCommandBuffer(cmd);
 
 	wait_stage_mask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
 
 	submit_info = {
 		.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
 		.waitSemaphoreCount = 1,
-		.pWaitSemaphores = &sema_present,
+		.pWaitSemaphores = &f.sema_present,
 		.pWaitDstStageMask = &wait_stage_mask,
 		.commandBufferCount = 1,
+		.pCommandBuffers = &f.cmd,
 		.signalSemaphoreCount = 1,
-		.pSignalSemaphores = &sema_render
+		.pSignalSemaphores = &swap_sema_render[image_idx]
 	};
 
 	present_info = {
 		.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
 		.waitSemaphoreCount = 1,
-		.pWaitSemaphores = &sema_render,
+		.pWaitSemaphores = &swap_sema_render[image_idx],
 		.swapchainCount = 1,
 		.pSwapchains = &swapchain
 	};
@@ -861,48 +1458,82 @@ int Vulkan::recreate_swapchain(int width, int height) {
 	sf_caps.currentExtent.width = width;
 	sf_caps.currentExtent.height = height;
 
-	vkDestroyFramebuffer(device, framebuffer, nullptr);
-	vkDestroyImageView(device, swap_image_view, nullptr);
-	vkResetCommandBuffer(draw_buffer, VK_COMMAND_BUFFER_RESET_RELEASE_RESOURCES_BIT);
+	destroy_swap_images();
+	for (int i = 0; i < FRAMES_IN_FLIGHT; i++)
+		vkResetCommandBuffer(frames[i].cmd, VK_COMMAND_BUFFER_RESET_RELEASE_RESOURCES_BIT);
 
 	vkDestroySwapchainKHR(device, swapchain, nullptr);
 
 	VkResult res = create_swapchain();
 		FAIL_IF(res != VK_SUCCESS, "vkCreateSwapchainKHR() failed (%d)\n", res)
 
-	uint32_t n_images = 1;
-	res = GetSwapchainImagesKHR(device, swapchain, &n_images, &swap_image);
-		FAIL_IF(res != VK_SUCCESS, "Could not acquire swapchain images (%d)\n", res)
+	return create_swap_images();
+}
 
-	VkImageViewCreateInfo iv_info = make_imageview_info(&swap_image, sf_color_fmt.format, VK_IMAGE_ASPECT_COLOR_BIT);
-	res = vkCreateImageView(device, &iv_info, nullptr, &swap_image_view);
-		FAIL_IF(res != VK_SUCCESS, "vkCreateImageView() failed (%d)\n", res)
+// Timestamps around the render pass, so that benchmarks can tell how long the GPU spent on a frame
+void Vulkan::create_timestamp_queries() {
+	if (!gpu_props.limits.timestampComputeAndGraphics)
+		return;
 
-	res = create_framebuffer();
-		FAIL_IF(res != VK_SUCCESS, "vkCreateFramebuffer() failed (%d)\n", res)
+	VkQueryPoolCreateInfo qp_info = {
+		.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+		.queryType = VK_QUERY_TYPE_TIMESTAMP,
+		.queryCount = 2 * FRAMES_IN_FLIGHT
+	};
 
-	int failure = update_command_buffers();
-	if (failure != 0)
-		return failure;
+	if (vkCreateQueryPool(device, &qp_info, nullptr, &timestamp_pool) != VK_SUCCESS)
+		timestamp_pool = VK_NULL_HANDLE;
+}
 
-	return 0;
+// Waits for the last frame to finish and returns how long it took on the GPU in milliseconds, or -1 if that can't be measured
+double Vulkan::last_frame_gpu_ms() {
+	if (!timestamp_pool)
+		return -1.0;
+
+	vkWaitForFences(device, 1, &frames[cur_frame].fence, VK_TRUE, MAX_64);
+
+	uint64_t ts[2];
+	VkResult res = vkGetQueryPoolResults(device, timestamp_pool, (uint32_t)cur_frame * 2, 2, sizeof(ts), ts, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT);
+	if (res != VK_SUCCESS)
+		return -1.0;
+
+	return (double)(ts[1] - ts[0]) * (double)gpu_props.limits.timestampPeriod / 1e6;
 }
 
+// Records and submits the current frame slot for whichever swapchain image comes back next.
+// This only waits if the same slot was submitted before and is still in flight, which happens when nothing changed since the last frame.
 int Vulkan::render() {
-	int idx;
-	VkResult res = AcquireNextImageKHR(device, swapchain, -1, sema_present, NULL, (uint32_t*)&idx);
-		FAIL_IF(res != VK_SUCCESS, "vkAcquireNextImageKHR() failed (%d)\n", res)
+	Frame_Slot& f = frames[cur_frame];
 
-	res = vkWaitForFences(device, 1, &draw_fence, VK_TRUE, -1);
+	VkResult res = vkWaitForFences(device, 1, &f.fence, VK_TRUE, -1);
 		FAIL_IF(res != VK_SUCCESS, "vkWaitForFences() failed (%d)\n", res)
 
-	res = vkResetFences(device, 1, &draw_fence);
+	int idx;
+	res = AcquireNextImageKHR(device, swapchain, -1, f.sema_present, NULL, (uint32_t*)&idx);
+		FAIL_IF(res != VK_SUCCESS && res != VK_SUBOPTIMAL_KHR, "vkAcquireNextImageKHR() failed (%d)\n", res)
+
+	int failure = update_command_buffers(idx);
+	if (failure != 0)
+		return failure;
+
+	res = vkResetFences(device, 1, &f.fence);
 		FAIL_IF(res != VK_SUCCESS, "vkResetFences() failed (%d)\n", res)
 
-	submit_info.pCommandBuffers = &draw_buffer;
-	res = vkQueueSubmit(queue, 1, &submit_info, draw_fence);
+	res = vkQueueSubmit(queue, 1, &submit_info, f.fence);
 		FAIL_IF(res != VK_SUCCESS, "vkQueueSubmit() failed (%d)\n", res)
 
+	// Only a hint, since every image still gets drawn in full
+	VkPresentRegionKHR region = {
+		.rectangleCount = (uint32_t)n_damage_rects,
+		.pRectangles = damage_rects
+	};
+	VkPresentRegionsKHR regions = {
+		.sType = VK_STRUCTURE_TYPE_PRESENT_REGIONS_KHR,
+		.swapchainCount = 1,
+		.pRegions = &region
+	};
+	present_info.pNext = has_incremental_present && n_damage_rects > 0 ? &regions : nullptr;
+
 	present_info.pImageIndices = (uint32_t*)&idx;
 	res = QueuePresentKHR(queue, &present_info);
 		FAIL_IF(res != VK_SUCCESS && res != VK_SUBOPTIMAL_KHR, "vkQueuePresentKHR() failed (%d)\n", res)